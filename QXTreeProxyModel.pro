@@ -7,9 +7,11 @@ TEMPLATE = app
 SOURCES += main.cpp \
     testdialog.cpp \
     qxtreeproxymodel.cpp \
+    qxsqltreemodel.cpp \
     mysqlrelationaldelegate.cpp
 HEADERS += testdialog.h \
     qxtreeproxymodel.h \
+    qxsqltreemodel.h \
     mysqlrelationaldelegate.h
 FORMS += testdialog.ui
 exists(../ModelTest-0_2/modeltest.pri) { 
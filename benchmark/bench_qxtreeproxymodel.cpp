@@ -0,0 +1,283 @@
+#include <QtTest/QtTest>
+#include <QStandardItemModel>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QSqlTableModel>
+#include <QMimeData>
+#include "qxtreeproxymodel.h"
+
+/* Benchmarks of the hot paths of QXTreeProxyModel. Each data row is a tree shape, a number of records and a source
+   model: a QStandardItemModel or a QSqlTableModel on an in-memory SQLite table, with OnManualSubmit ("sqlite") or,
+   for removals and drops, also with OnRowChange ("sqlite-rowchange"), which takes the SQL paths for whole branches.
+   Record ids are 1..rows in source row order, and the parent of each record has a smaller id, thus the record with the
+   largest id is a leaf in every shape, and so is the one with the largest remaining id after it is removed. Drops drag
+   the leaves of the generated tree (see leafRows()); the deep tree has a single leaf, which is dragged repeatedly.
+   Queries are timed on a fixed sample of records, such that the numbers show how the cost per call grows with the size
+   of the tree; structural changes are timed once for a fixed number of operations, as they change the tree. */
+class BenchQXTreeProxyModel : public QObject{
+   Q_OBJECT
+public:
+   BenchQXTreeProxyModel();
+private slots:
+   void initTestCase();
+   void cleanup();
+   void build_data() {addDataRows();}
+   void build();
+   void index_data() {addDataRows();}
+   void index();
+   void parent_data() {addDataRows();}
+   void parent();
+   void rowCount_data() {addDataRows();}
+   void rowCount();
+   void mapFromSource_data() {addDataRows();}
+   void mapFromSource();
+   void dataFontRole_data() {addDataRows();}
+   void dataFontRole();
+   void insertRows_data() {addDataRows();}
+   void insertRows();
+   void removeRows_data() {addDataRows(true);}
+   void removeRows();
+   void moveDrop_data() {addDataRows(true);}
+   void moveDrop();
+   void copyDrop_data() {addDataRows(true);}
+   void copyDrop();
+private:
+   enum {Samples = 1000, Operations = 100};
+   enum {ContentCol, IdCol, ParentCol};
+   QAbstractItemModel* d_source;
+   QXTreeProxyModel* d_proxy;
+   QVector<qint32> d_parentIds;      // parent id of each record, indexed by source row
+   void addDataRows(bool rowChange = false);
+   void createModels();
+   void createStandardSource();
+   void createSqlSource(QSqlTableModel::EditStrategy strategy);
+   static QVector<qint32> parentIds(const QString& shape, int rows);
+   QModelIndex proxyIndexOfRow(int sourceRow, int column = 0) const;
+   QList<int> sampleRows() const;
+   QList<int> leafRows() const;
+   bool drop(int sourceRow, int newParentRow, Qt::DropAction action);};
+
+BenchQXTreeProxyModel::BenchQXTreeProxyModel(): d_source(0), d_proxy(0) {}
+
+void BenchQXTreeProxyModel::initTestCase(){
+   QSqlDatabase db = QSqlDatabase::addDatabase(QLatin1String("QSQLITE"));
+   db.setDatabaseName(QLatin1String(":memory:"));
+   QVERIFY(db.open());}
+
+void BenchQXTreeProxyModel::cleanup(){
+   delete d_proxy;
+   d_proxy = 0;
+   delete d_source;      // before the table is dropped by the next data row
+   d_source = 0;
+   d_parentIds.clear();}
+
+// columns shape, rows and source; tags like "deep/100000/sqlite"; with rowChange also "deep/100000/sqlite-rowchange"
+void BenchQXTreeProxyModel::addDataRows(bool rowChange){
+   QTest::addColumn<QString>("shape");
+   QTest::addColumn<int>("rows");
+   QTest::addColumn<QString>("source");
+   QStringList shapes;
+   shapes << QLatin1String("wide") << QLatin1String("deep") << QLatin1String("balanced") << QLatin1String("random");
+   QStringList sources;
+   sources << QLatin1String("standard") << QLatin1String("sqlite");
+   if (rowChange) sources << QLatin1String("sqlite-rowchange");
+   foreach (const QString& shape, shapes) for (int rows(1000); rows <= 1000000; rows *= 10) foreach (const QString& source, sources)
+      QTest::newRow(QString(QLatin1String("%1/%2/%3")).arg(shape).arg(rows).arg(source).toLatin1().constData()) << shape << rows << source;}
+
+/* parent ids for records 1..rows:
+   - wide: all records are first level rows
+   - deep: a single chain, each record is the only child of the previous one
+   - balanced: binary tree, record i is the child of record i/2
+   - random: each record is the child of a random record with smaller id (or of the root) */
+QVector<qint32> BenchQXTreeProxyModel::parentIds(const QString& shape, int rows){
+   QVector<qint32> result(rows);
+   quint32 seed(12345u);      // own generator, thus the random tree is the same on all platforms
+   for (int r(0); r < rows; ++r){
+      qint32 id(r + 1);
+      if (shape == QLatin1String("wide")) result[r] = 0;
+      else if (shape == QLatin1String("deep")) result[r] = id - 1;
+      else if (shape == QLatin1String("balanced")) result[r] = id / 2;
+      else {
+         seed = seed * 1103515245u + 12345u;
+         result[r] = qint32((seed >> 8) % quint32(id));}}
+   return result;}
+
+// source model and proxy for the current data row
+void BenchQXTreeProxyModel::createModels(){
+   QFETCH(QString, shape);
+   QFETCH(int, rows);
+   QFETCH(QString, source);
+   d_parentIds = parentIds(shape, rows);
+   if (source == QLatin1String("sqlite")) createSqlSource(QSqlTableModel::OnManualSubmit);
+   else if (source == QLatin1String("sqlite-rowchange")) createSqlSource(QSqlTableModel::OnRowChange);
+   else createStandardSource();
+   QVERIFY(d_source);
+   QCOMPARE(d_source->rowCount(), rows);
+   d_proxy = new QXTreeProxyModel(this);
+   d_proxy->setSourceModel(d_source);
+   QVERIFY(d_proxy->setIdCol(IdCol));
+   QVERIFY(d_proxy->setParentCol(ParentCol));
+   QVERIFY(d_proxy->integrityReport().isValid());}
+
+void BenchQXTreeProxyModel::createStandardSource(){
+   QStandardItemModel* model = new QStandardItemModel(d_parentIds.count(), 3, this);
+   for (int r(0); r < d_parentIds.count(); ++r){
+      model->setItem(r, ContentCol, new QStandardItem(QString(QLatin1String("item %1")).arg(r + 1)));
+      model->setItem(r, IdCol, new QStandardItem(QString::number(r + 1)));
+      model->setItem(r, ParentCol, new QStandardItem(QString::number(d_parentIds.at(r))));}
+   d_source = model;}
+
+void BenchQXTreeProxyModel::createSqlSource(QSqlTableModel::EditStrategy strategy){
+   QSqlDatabase db = QSqlDatabase::database();
+   QSqlQuery query(db);
+   QVERIFY(query.exec(QLatin1String("DROP TABLE IF EXISTS Tree;")));
+   QVERIFY(query.exec(QLatin1String("CREATE TABLE Tree (Content, Identifier INTEGER PRIMARY KEY, Parent INTEGER NOT NULL);")));
+   QVariantList contents;
+   QVariantList ids;
+   QVariantList parents;
+   for (int r(0); r < d_parentIds.count(); ++r){
+      contents << QString(QLatin1String("item %1")).arg(r + 1);
+      ids << r + 1;
+      parents << d_parentIds.at(r);}
+   QVERIFY(db.transaction());
+   QVERIFY(query.prepare(QLatin1String("INSERT INTO Tree (Content, Identifier, Parent) VALUES (?, ?, ?);")));
+   query.addBindValue(contents);
+   query.addBindValue(ids);
+   query.addBindValue(parents);
+   QVERIFY(query.execBatch());
+   QVERIFY(db.commit());
+   QSqlTableModel* model = new QSqlTableModel(this, db);
+   model->setTable(QLatin1String("Tree"));
+   model->setEditStrategy(strategy);
+   model->setSort(IdCol, Qt::AscendingOrder);      // source row r holds id r + 1
+   d_source = model;
+   QVERIFY(model->select());
+   while (model->canFetchMore()) model->fetchMore();}
+
+QModelIndex BenchQXTreeProxyModel::proxyIndexOfRow(int sourceRow, int column) const {
+   return d_proxy->mapFromSource(d_source->index(sourceRow, column));}
+
+// source rows of the sampled records, spread evenly over the table
+QList<int> BenchQXTreeProxyModel::sampleRows() const {
+   QList<int> result;
+   int rows = d_source->rowCount();
+   int samples = qMin(int(Samples), rows);
+   for (int i(0); i < samples; ++i) result << int(qint64(i) * rows / samples);
+   return result;}
+
+// source rows of up to Operations records without children, largest ids first; never the first record, the drop target
+QList<int> BenchQXTreeProxyModel::leafRows() const {
+   QVector<bool> hasChildren(d_parentIds.count() + 1, false);      // indexed by id
+   foreach (qint32 parentId, d_parentIds) hasChildren[parentId] = true;
+   QList<int> result;
+   for (int r(d_parentIds.count() - 1); r > 0 && result.count() < Operations; --r) if (!hasChildren.at(r + 1)) result << r;
+   return result;}
+
+// drags the record in sourceRow onto the record in newParentRow (or onto the root if newParentRow < 0)
+bool BenchQXTreeProxyModel::drop(int sourceRow, int newParentRow, Qt::DropAction action){
+   QMimeData* mimeData = d_proxy->mimeData(QModelIndexList() << proxyIndexOfRow(sourceRow));
+   QModelIndex newParent = (newParentRow < 0) ? QModelIndex() : proxyIndexOfRow(newParentRow);
+   bool ok = d_proxy->dropMimeData(mimeData, action, -1, 0, newParent);
+   delete mimeData;
+   return ok;}
+
+// full build of the tree from the source model
+void BenchQXTreeProxyModel::build(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QBENCHMARK{
+      QXTreeProxyModel proxy;
+      proxy.setSourceModel(d_source);
+      proxy.setParentCol(ParentCol);      // no build yet, as idCol is not set
+      proxy.setIdCol(IdCol);}}            // single full build
+
+void BenchQXTreeProxyModel::index(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QList<QPair<int, QModelIndex> > positions;      // row and parent of each sampled record
+   foreach (int r, sampleRows()){
+      QModelIndex idx = proxyIndexOfRow(r);
+      positions << qMakePair(idx.row(), idx.parent());}
+   QBENCHMARK{
+      for (int i(0); i < positions.count(); ++i) d_proxy->index(positions.at(i).first, 0, positions.at(i).second);}}
+
+void BenchQXTreeProxyModel::parent(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QModelIndexList indexes;
+   foreach (int r, sampleRows()) indexes << proxyIndexOfRow(r);
+   QBENCHMARK{
+      foreach (const QModelIndex& idx, indexes) d_proxy->parent(idx);}}
+
+void BenchQXTreeProxyModel::rowCount(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QModelIndexList indexes;
+   foreach (int r, sampleRows()) indexes << proxyIndexOfRow(r).parent();      // parents, thus the root is included
+   QBENCHMARK{
+      foreach (const QModelIndex& idx, indexes) d_proxy->rowCount(idx);}}
+
+void BenchQXTreeProxyModel::mapFromSource(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QModelIndexList sourceIndexes;
+   foreach (int r, sampleRows()) sourceIndexes << d_source->index(r, ContentCol);
+   QBENCHMARK{
+      foreach (const QModelIndex& idx, sourceIndexes) d_proxy->mapFromSource(idx);}}
+
+void BenchQXTreeProxyModel::dataFontRole(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QModelIndexList indexes;
+   foreach (int r, sampleRows()) indexes << proxyIndexOfRow(r, ContentCol);
+   QBENCHMARK{
+      foreach (const QModelIndex& idx, indexes) d_proxy->data(idx, Qt::FontRole);}}
+
+// appends Operations rows below the first record, one by one
+void BenchQXTreeProxyModel::insertRows(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QPersistentModelIndex parentIndex = proxyIndexOfRow(0);
+   bool ok(true);
+   QBENCHMARK_ONCE{
+      for (int i(0); i < Operations && ok; ++i) ok = d_proxy->insertRows(d_proxy->rowCount(parentIndex), 1, parentIndex);}
+   QVERIFY(ok);}
+
+// removes the Operations records with the largest ids, each a leaf when it is removed
+void BenchQXTreeProxyModel::removeRows(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   int rows = d_source->rowCount();
+   bool ok(true);
+   QBENCHMARK_ONCE{
+      for (int i(0); i < Operations && ok; ++i){
+         QModelIndex idx = proxyIndexOfRow(rows - 1 - i);
+         ok = d_proxy->removeRows(idx.row(), 1, idx.parent());}}
+   QVERIFY(ok);}
+
+// moves leaves below the first record and back to their parent, i.e., 2 * Operations drops
+void BenchQXTreeProxyModel::moveDrop(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QList<int> leaves = leafRows();
+   QVERIFY(!leaves.isEmpty());
+   bool ok(true);
+   QBENCHMARK_ONCE{
+      for (int i(0); i < Operations && ok; ++i){
+         int r(leaves.at(i % leaves.count()));
+         ok = drop(r, 0, Qt::MoveAction) && drop(r, d_parentIds.at(r) - 1, Qt::MoveAction);}}
+   QVERIFY(ok);}
+
+// copies leaves below the first record, Operations drops of a single record each
+void BenchQXTreeProxyModel::copyDrop(){
+   createModels();
+   if (QTest::currentTestFailed()) return;
+   QList<int> leaves = leafRows();
+   QVERIFY(!leaves.isEmpty());
+   bool ok(true);
+   QBENCHMARK_ONCE{
+      for (int i(0); i < Operations && ok; ++i) ok = drop(leaves.at(i % leaves.count()), 0, Qt::CopyAction);}
+   QVERIFY(ok);}
+
+QTEST_MAIN(BenchQXTreeProxyModel)
+#include "bench_qxtreeproxymodel.moc"
@@ -0,0 +1,14 @@
+# -------------------------------------------------
+# QTest benchmarks of QXTreeProxyModel, separate from the test dialog
+# run e.g. "./bench_qxtreeproxymodel parent:deep/100000/sqlite" to select a single data row
+# -------------------------------------------------
+QT += sql testlib
+TARGET = bench_qxtreeproxymodel
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+INCLUDEPATH += ..
+DEPENDPATH += ..
+SOURCES += bench_qxtreeproxymodel.cpp \
+    ../qxtreeproxymodel.cpp
+HEADERS += ../qxtreeproxymodel.h
@@ -27,27 +27,17 @@ mySqlRelationalDelegate::mySqlRelationalDelegate(QObject *parent) :
 
 QWidget *mySqlRelationalDelegate::createEditor(QWidget *aParent, const QStyleOptionViewItem &option, const QModelIndex &index) const {
 
-    const QSqlRelationalTableModel *sqlModel = qobject_cast<const QSqlRelationalTableModel *>(index.model());
-    QSqlTableModel *childModel = sqlModel ? sqlModel->relationModel(index.column()) : 0;
+    const Relation &rel = relation(index.model(), index.column());
 
-    if (!childModel )
-    {
-        const QAbstractProxyModel* proxyModel = qobject_cast<const QAbstractProxyModel *>(index.model());
-        if (proxyModel)
-        {
-            sqlModel = qobject_cast<const QSqlRelationalTableModel *>(proxyModel->sourceModel());
-            childModel = sqlModel ? sqlModel->relationModel(index.column()) : 0;
-        }
-    }
-
-    if (!childModel)
+    if (!rel.childModel)
     {
         return QItemDelegate::createEditor(aParent, option, index);
     }
 
+    // all editors of a column share the relation model, no copy per editor
     QComboBox *combo = new QComboBox(aParent);
-    combo->setModel(childModel);
-    combo->setModelColumn(childModel->fieldIndex(sqlModel->relation(index.column()).displayColumn()));
+    combo->setModel(rel.childModel);
+    combo->setModelColumn(rel.displayColumn);
     combo->installEventFilter(const_cast<mySqlRelationalDelegate *>(this));
 
     return combo;
@@ -56,17 +46,7 @@ QWidget *mySqlRelationalDelegate::createEditor(QWidget *aParent, const QStyleOpt
 
 void mySqlRelationalDelegate::setEditorData(QWidget *editor, const QModelIndex &index) const
 {
-    QString strVal = "";
-    const QSqlRelationalTableModel *sqlModel = qobject_cast<const QSqlRelationalTableModel *>(index.model());
-    if (!sqlModel )
-    {
-        const QAbstractProxyModel* proxyModel = qobject_cast<const QAbstractProxyModel *>(index.model());
-        if (proxyModel) {
-            strVal = proxyModel->data(index).toString();
-        }
-    } else {
-        strVal = sqlModel->data(index).toString();
-    }
+    QString strVal = index.isValid() ? index.model()->data(index).toString() : QString();
 
     QComboBox *combo = qobject_cast<QComboBox *>(editor);
     if (strVal.isEmpty() || !combo) {
@@ -74,7 +54,27 @@ void mySqlRelationalDelegate::setEditorData(QWidget *editor, const QModelIndex &
         return;
     }
 
-    combo->setCurrentIndex(combo->findText(strVal));
+    Relation &rel = relation(index.model(), index.column());
+    if (!rel.childModel) {
+        combo->setCurrentIndex(combo->findText(strVal));
+        return;
+    }
+
+    // hash lookup instead of combo->findText(), which compares the text of every row
+    if (!rel.rowsKnown)
+    {
+        rel.rowFromText.clear();
+        int rows = rel.childModel->rowCount();
+        rel.rowFromText.reserve(rows);
+        for (int r = 0; r < rows; ++r)
+        {
+            QString text = rel.childModel->data(rel.childModel->index(r, rel.displayColumn)).toString();
+            if (!rel.rowFromText.contains(text))    // as findText(): the first row wins
+                rel.rowFromText.insert(text, r);
+        }
+        rel.rowsKnown = true;
+    }
+    combo->setCurrentIndex(rel.rowFromText.value(strVal, -1));
 }
 
 void mySqlRelationalDelegate::setModelData(QWidget *editor, QAbstractItemModel *model, const QModelIndex &index) const
@@ -82,32 +82,55 @@ void mySqlRelationalDelegate::setModelData(QWidget *editor, QAbstractItemModel *
     if (!index.isValid())
         return;
 
-    QSqlRelationalTableModel *sqlModel = qobject_cast<QSqlRelationalTableModel *>(model);
-    QAbstractProxyModel* proxyModel = NULL;
-    if (!sqlModel )
-    {
-        proxyModel = qobject_cast<QAbstractProxyModel *>(model);
-        if (proxyModel)
-             sqlModel = qobject_cast<QSqlRelationalTableModel *>(proxyModel->sourceModel());
-    }
-
-    QSqlTableModel *childModel = sqlModel ? sqlModel->relationModel(index.column()) : 0;
+    const Relation &rel = relation(model, index.column());
     QComboBox *combo = qobject_cast<QComboBox *>(editor);
-    if (!sqlModel || !childModel || !combo) {
+    if (!rel.childModel || !combo) {
         QItemDelegate::setModelData(editor, model, index);
         return;
     }
 
+    // setting the key is sufficient: the model derives the display value from it
+    // (and QSqlTableModel ignores setData() with Qt::DisplayRole anyway)
     int currentItem = combo->currentIndex();
-    int childColIndex = childModel->fieldIndex(sqlModel->relation(index.column()).displayColumn());
-    int childEditIndex = childModel->fieldIndex(sqlModel->relation(index.column()).indexColumn());
+    model->setData(index, rel.childModel->data(rel.childModel->index(currentItem, rel.indexColumn), Qt::EditRole), Qt::EditRole);
+}
+
+// resolves the relation of column in model (directly or as source of a proxy model) once and caches it
+mySqlRelationalDelegate::Relation &mySqlRelationalDelegate::relation(const QAbstractItemModel *model, int column) const
+{
+    RelationKey key(model, column);
+    QHash<RelationKey, Relation>::iterator it = relations.find(key);
+    if (it != relations.end())
+        return it.value();
 
+    const QSqlRelationalTableModel *sqlModel = qobject_cast<const QSqlRelationalTableModel *>(model);
+    if (!sqlModel)
+    {
+        const QAbstractProxyModel* proxyModel = qobject_cast<const QAbstractProxyModel *>(model);
+        if (proxyModel)
+            sqlModel = qobject_cast<const QSqlRelationalTableModel *>(proxyModel->sourceModel());
+    }
 
-    if (proxyModel) {
-        proxyModel->setData(index, childModel->data(childModel->index(currentItem, childColIndex), Qt::DisplayRole), Qt::DisplayRole);
-        proxyModel->setData(index, childModel->data(childModel->index(currentItem, childEditIndex), Qt::EditRole), Qt::EditRole);
-    } else {
-        sqlModel->setData(index, childModel->data(childModel->index(currentItem, childColIndex), Qt::DisplayRole), Qt::DisplayRole);
-        sqlModel->setData(index, childModel->data(childModel->index(currentItem, childEditIndex), Qt::EditRole), Qt::EditRole);
+    Relation &rel = relations[key];
+    rel.childModel = sqlModel ? sqlModel->relationModel(column) : 0;
+    if (rel.childModel)
+    {
+        rel.displayColumn = rel.childModel->fieldIndex(sqlModel->relation(column).displayColumn());
+        rel.indexColumn = rel.childModel->fieldIndex(sqlModel->relation(column).indexColumn());
+        // rows of the relation model changed: the text hash is outdated
+        connect(rel.childModel, SIGNAL(modelReset()), this, SLOT(clearRelations()), Qt::UniqueConnection);
+        connect(rel.childModel, SIGNAL(layoutChanged()), this, SLOT(clearRelations()), Qt::UniqueConnection);
+        connect(rel.childModel, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(clearRelations()), Qt::UniqueConnection);
+        connect(rel.childModel, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(clearRelations()), Qt::UniqueConnection);
+        connect(rel.childModel, SIGNAL(rowsRemoved(QModelIndex,int,int)), this, SLOT(clearRelations()), Qt::UniqueConnection);
     }
+    // the view's model is reset (e.g. gets a new source model) or deleted: resolve again
+    connect(model, SIGNAL(modelReset()), this, SLOT(clearRelations()), Qt::UniqueConnection);
+    connect(model, SIGNAL(destroyed()), this, SLOT(clearRelations()), Qt::UniqueConnection);
+    return rel;
+}
+
+void mySqlRelationalDelegate::clearRelations()
+{
+    relations.clear();
 }
@@ -15,6 +15,10 @@
 #define MYSQLRELATIONALDELEGATE_H
 
 #include <QSqlRelationalDelegate>
+#include <QHash>
+#include <QPair>
+
+class QSqlTableModel;
 
 class mySqlRelationalDelegate : public QSqlRelationalDelegate
 {
@@ -30,6 +34,23 @@ signals:
 
 public slots:
 
+private slots:
+    void clearRelations();
+
+private:
+    // relation of a column of a view's model, resolved once; childModel is 0 for columns without relation
+    struct Relation
+    {
+        QSqlTableModel *childModel;
+        int displayColumn;
+        int indexColumn;
+        QHash<QString, int> rowFromText;    // row in childModel of each display text, built on first use
+        bool rowsKnown;
+        Relation() : childModel(0), displayColumn(-1), indexColumn(-1), rowsKnown(false) {}
+    };
+    typedef QPair<const QAbstractItemModel *, int> RelationKey;
+    mutable QHash<RelationKey, Relation> relations;
+    Relation &relation(const QAbstractItemModel *model, int column) const;
 };
 
 #endif // MYSQLRELATIONALDELEGATE_H
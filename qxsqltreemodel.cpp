@@ -0,0 +1,384 @@
+#include "qxsqltreemodel.h"
+#include <QSqlDriver>
+#include <QStringList>
+#include <qdebug.h>
+#include <boost/cast.hpp>
+
+/*!
+  \class QXSqlTreeModel
+  \brief QXSqlTreeModel is a read-only tree model that queries the children of each item directly from an SQL table
+
+  License: LGPL
+  This software is written using the non-commercial LGLP version of Qt. There are no additional restrictions
+  to the use of this software than those that are mandated by the underlying Qt license. See http://qt.nokia.com
+
+  QXSqlTreeModel inherits QAbstractItemModel.
+
+  The table has the same structure as the source model of QXTreeProxyModel: an id column with a unique, non-zero
+  integer key and a parent column that refers to the id of the parent record; an empty parent field or 0 defines the
+  first level rows. Other than QXTreeProxyModel, this model does not need the whole table loaded. The children of an
+  item are queried when a view asks for them, by prepared statements of the form SELECT ... WHERE Parent = ? ORDER BY
+  Id; siblings are fetched in pages of 256 records, and only the most recently used pages are kept (see cacheSize).
+  The position of each record (its parent and row) is kept as long as its page is, and queried again for indexes whose
+  page was discarded. Thus, memory scales with the cache size and the number of items asked for their children, not
+  with the size of the table. Each child list is queried by its parent, thus the parent column should be indexed; for
+  SQLite databases select() creates such an index if createParentIndex is set.
+
+  Siblings are ordered by their id, which in SQLite corresponds to the order of the records in the table (as in
+  QXTreeProxyModel with a QSqlTableModel as source) if the id column is the INTEGER PRIMARY KEY.
+
+  The model is read-only and does not notice changes to the table by others; call select() to show them.
+  */
+
+/*!
+  \brief constructor
+
+  The parameter parent is forwarded to QAbstractItemModel, db is the database connection to be used
+  (the default connection if not given).
+*/
+QXSqlTreeModel::QXSqlTreeModel(QObject* parent, QSqlDatabase db) : QAbstractItemModel(parent),
+   d_db(db.isValid() ? db : QSqlDatabase::database()), idColumn(-1), parentColumn(-1), d_selected(false), d_createParentIndex(false),
+   d_pageQuery(d_db), d_rootPageQuery(d_db), d_countQuery(d_db), d_rootCountQuery(d_db), d_parentQuery(d_db), d_rowQuery(d_db),
+   d_rootRowQuery(d_db), d_pages(64) {
+   }
+
+/*!
+  \brief destructor
+*/
+QXSqlTreeModel::~QXSqlTreeModel(){
+   d_pages.clear();}     // pages remove their entries from d_nodes, which is destroyed first
+
+// getters and setters
+
+/*!
+  \brief returns the database connection
+*/
+QSqlDatabase QXSqlTreeModel::database() const {
+   return d_db;}
+
+/*!
+  \brief returns the name of the table, see setTable()
+*/
+QString QXSqlTreeModel::tableName() const {
+   return d_tableName;}
+
+/*!
+  \brief sets the table to be shown
+
+  The model stays empty until select() is called.
+*/
+void QXSqlTreeModel::setTable(const QString& tableName){
+   beginResetModel();
+   d_tableName = tableName;
+   d_selected = false;
+   clearCaches();
+   endResetModel();}
+
+/*!
+  \property QXSqlTreeModel::idCol
+  \brief index of column that holds unique key for each record
+
+  Same requirements as for QXTreeProxyModel::idCol. Takes effect with the next call to select().
+*/
+/*!
+  \brief getter function
+
+  \sa idCol
+*/
+int QXSqlTreeModel::idCol() const {
+   return idColumn;}
+
+/*!
+  \brief setter function
+
+  \sa idCol
+*/
+bool QXSqlTreeModel::setIdCol(unsigned int col){
+   idColumn = boost::numeric_cast<int>(col);
+   return true;}
+
+/*!
+  \property QXSqlTreeModel::parentCol
+  \brief index of column that refers to parent of each record
+
+  Same requirements as for QXTreeProxyModel::parentCol. Takes effect with the next call to select().
+*/
+/*!
+  \brief getter function
+
+  \sa parentCol
+*/
+int QXSqlTreeModel::parentCol() const {
+   return parentColumn;}
+
+/*!
+  \brief setter function
+
+  \sa parentCol
+*/
+bool QXSqlTreeModel::setParentCol(unsigned int col){
+   parentColumn = boost::numeric_cast<int>(col);
+   return true;}
+
+/*!
+  \property QXSqlTreeModel::cacheSize
+  \brief maximum number of sibling pages (of 256 records each) kept in memory
+
+  Pages that were not used recently are discarded and queried again when needed. Default is 64.
+*/
+/*!
+  \brief getter function
+
+  \sa cacheSize
+*/
+int QXSqlTreeModel::cacheSize() const {
+   return d_pages.maxCost();}
+
+/*!
+  \brief setter function
+
+  \sa cacheSize
+*/
+void QXSqlTreeModel::setCacheSize(int pages){
+   d_pages.setMaxCost(qMax(pages, 1));}   // at least the page in use must fit
+
+/*!
+  \property QXSqlTreeModel::createParentIndex
+  \brief whether select() creates an index on the parent column of an SQLite table
+
+  Every child list is queried by its parent; without an index on the parent column each query scans the whole table.
+  If this property is true, select() runs CREATE INDEX IF NOT EXISTS on the parent column (for SQLite databases only),
+  i.e., it changes the schema of the database. Default is false: the index must be provided by the database.
+*/
+/*!
+  \brief getter function
+
+  \sa createParentIndex
+*/
+bool QXSqlTreeModel::createParentIndex() const {
+   return d_createParentIndex;}
+
+/*!
+  \brief setter function
+
+  \sa createParentIndex
+*/
+void QXSqlTreeModel::setCreateParentIndex(bool enable){
+   d_createParentIndex = enable;}
+
+/*!
+  \brief returns information about the last error that occurred on the database
+*/
+QSqlError QXSqlTreeModel::lastError() const {
+   return d_lastError;}
+
+/*!
+  \brief (re-)populates the model from the table
+
+  Prepares the queries for the table set by setTable() and the columns set by setIdCol() and setParentCol(), and
+  discards all records fetched so far. Creates an index on the parent column if createParentIndex is set. Returns false
+  if the table or its columns are not valid or a query cannot be prepared; see lastError().
+*/
+bool QXSqlTreeModel::select(){
+   beginResetModel();
+   clearCaches();
+   d_selected = false;
+   d_record = d_db.record(d_tableName);
+   if (d_record.count() == 0 || idCol() < 0 || idCol() >= d_record.count() || parentCol() < 0 || parentCol() >= d_record.count()){
+      endResetModel();
+      return false;}
+   QSqlDriver* driver = d_db.driver();
+   QString table = driver->escapeIdentifier(d_tableName, QSqlDriver::TableName);
+   QString idField = driver->escapeIdentifier(d_record.fieldName(idCol()), QSqlDriver::FieldName);
+   QString parentField = driver->escapeIdentifier(d_record.fieldName(parentCol()), QSqlDriver::FieldName);
+   QStringList fields;
+   for (int c(0); c < d_record.count(); ++c) fields << driver->escapeIdentifier(d_record.fieldName(c), QSqlDriver::FieldName);
+   // every child list is queried by its parent: without an index on the parent column each query scans the table
+   if (d_createParentIndex && d_db.driverName().startsWith(QLatin1String("QSQLITE"))){
+      QString indexName = driver->escapeIdentifier(d_tableName + QLatin1String("_") + d_record.fieldName(parentCol()) + QLatin1String("_index"),
+                                                   QSqlDriver::TableName);
+      QSqlQuery indexQuery(d_db);
+      if (!indexQuery.exec(QString(QLatin1String("CREATE INDEX IF NOT EXISTS %1 ON %2 (%3)")).arg(indexName).arg(table).arg(parentField)))
+         d_lastError = indexQuery.lastError();}     // not fatal, queries are only slower
+   QString isChild = parentField + QLatin1String(" = ?");
+   QString isRoot = QString(QLatin1String("(%1 IS NULL OR %1 = 0 OR %1 = '')")).arg(parentField);
+   QString selectPage = QString(QLatin1String("SELECT %1 FROM %2 WHERE %3 ORDER BY %4 LIMIT ? OFFSET ?")).arg(fields.join(QLatin1String(", "))).arg(table);
+   QString selectCount = QString(QLatin1String("SELECT COUNT(*) FROM %1 WHERE %2")).arg(table);
+   QString selectRow = selectCount + QString(QLatin1String(" AND %1 < ?")).arg(idField);     // row = siblings with smaller id
+   bool ok(true);
+   if (ok && !(ok = d_pageQuery.prepare(selectPage.arg(isChild).arg(idField)))) d_lastError = d_pageQuery.lastError();
+   if (ok && !(ok = d_rootPageQuery.prepare(selectPage.arg(isRoot).arg(idField)))) d_lastError = d_rootPageQuery.lastError();
+   if (ok && !(ok = d_countQuery.prepare(selectCount.arg(isChild)))) d_lastError = d_countQuery.lastError();
+   if (ok && !(ok = d_rootCountQuery.prepare(selectCount.arg(isRoot)))) d_lastError = d_rootCountQuery.lastError();
+   if (ok && !(ok = d_parentQuery.prepare(QString(QLatin1String("SELECT %1 FROM %2 WHERE %3 = ?")).arg(parentField).arg(table).arg(idField))))
+      d_lastError = d_parentQuery.lastError();
+   if (ok && !(ok = d_rowQuery.prepare(selectRow.arg(isChild)))) d_lastError = d_rowQuery.lastError();
+   if (ok && !(ok = d_rootRowQuery.prepare(selectRow.arg(isRoot)))) d_lastError = d_rootRowQuery.lastError();
+   d_selected = ok;
+   endResetModel();
+   return ok;}
+
+// reimplemented virtual functions (basic set)
+/*!
+  \brief reimplemented function
+*/
+QModelIndex QXSqlTreeModel::index(int row, int column, const QModelIndex& parent) const {
+   if (!hasIndex(row, column, parent)) return QModelIndex();
+   const SiblingPage* siblings = page(getId(parent), row / PageSize);
+   if (!siblings || row % PageSize >= siblings->ids.count()) return QModelIndex();   // table changed since counted
+   return createIndex(row, column, siblings->ids.at(row % PageSize));}
+
+/*!
+  \brief reimplemented function
+*/
+QModelIndex QXSqlTreeModel::parent(const QModelIndex& child) const {
+   if (!child.isValid()) return QModelIndex();
+   NodeInfo info;
+   if (!node(getId(child), info) || info.parentId == 0) return QModelIndex();     // record deleted meanwhile
+   qint32 parentId = info.parentId;
+   if (!node(parentId, info)) return QModelIndex();
+   return createIndex(info.row, 0, parentId);}   //AQP: all rows are child of parent's 1st column
+
+/*!
+  \brief reimplemented function
+*/
+bool QXSqlTreeModel::hasChildren(const QModelIndex& parent) const {
+   return rowCount(parent) > 0;}     // counted once per item and cached, no need to fetch the children
+
+/*!
+  \brief reimplemented function
+*/
+int QXSqlTreeModel::rowCount(const QModelIndex& parent) const {
+   if (!d_selected) return 0;
+   if (parent.isValid() && parent.column() != 0) return 0;   // AQP: only first column is parent in tree model
+   return childCount(getId(parent));}
+
+/*!
+  \brief reimplemented function
+*/
+int QXSqlTreeModel::columnCount(const QModelIndex& parent) const {
+   Q_UNUSED(parent);
+   return d_selected ? d_record.count() : 0;}
+
+/*!
+  \brief reimplemented function
+*/
+QVariant QXSqlTreeModel::data(const QModelIndex& index, int role) const {
+   if (!index.isValid() || (role != Qt::DisplayRole && role != Qt::EditRole)) return QVariant();
+   qint32 id = getId(index);
+   NodeInfo info;
+   if (!node(id, info)) return QVariant();
+   int row = info.row;
+   const SiblingPage* siblings = page(info.parentId, row / PageSize);
+   if (!siblings || row % PageSize >= siblings->ids.count() || siblings->ids.at(row % PageSize) != id) return QVariant();
+   return siblings->values.at((row % PageSize) * d_record.count() + index.column());}
+
+/*!
+  \brief reimplemented function
+
+  Returns the field names as horizontal header.
+*/
+QVariant QXSqlTreeModel::headerData(int section, Qt::Orientation orientation, int role) const {
+   if (orientation == Qt::Horizontal && role == Qt::DisplayRole && section >= 0 && section < d_record.count())
+      return d_record.fieldName(section);
+   return QAbstractItemModel::headerData(section, orientation, role);}
+
+/*!
+  \brief reimplemented function
+
+  Items are not editable.
+*/
+Qt::ItemFlags QXSqlTreeModel::flags(const QModelIndex& index) const {
+   if (!index.isValid()) return Qt::NoItemFlags;
+   return Qt::ItemIsEnabled | Qt::ItemIsSelectable;}
+
+// private functions
+
+void QXSqlTreeModel::clearCaches(){
+   d_pages.clear();
+   d_childCount.clear();
+   d_nodes.clear();}
+
+qint32 QXSqlTreeModel::getId(const QModelIndex& index) const {
+   Q_ASSERT(index.model() == NULL || index.model() == this);
+   return index.isValid() ? qint32(index.internalId()) : 0;}
+
+// number of children of parentId, queried once and cached until the next select()
+int QXSqlTreeModel::childCount(qint32 parentId) const {
+   QHash<qint32, int>::const_iterator iter = d_childCount.constFind(parentId);
+   if (iter != d_childCount.constEnd()) return iter.value();
+   QSqlQuery& query = (parentId == 0) ? d_rootCountQuery : d_countQuery;
+   if (parentId != 0) query.bindValue(0, parentId);
+   int count(0);
+   if (query.exec() && query.next()) count = query.value(0).toInt();
+   else d_lastError = query.lastError();
+   query.finish();
+   d_childCount.insert(parentId, count);
+   return count;}
+
+/* Returns the siblings pageNumber * PageSize to (pageNumber + 1) * PageSize - 1 among the children of parentId,
+   from the cache or queried from the table (0 if the query fails). The returned page remains valid only until
+   the next call, as that might discard it from the cache. */
+const QXSqlTreeModel::SiblingPage* QXSqlTreeModel::page(qint32 parentId, int pageNumber) const {
+   PageKey key(parentId, pageNumber);
+   SiblingPage* siblings = d_pages.object(key);
+   if (siblings) return siblings;
+   QSqlQuery& query = (parentId == 0) ? d_rootPageQuery : d_pageQuery;
+   int pos(0);
+   if (parentId != 0) query.bindValue(pos++, parentId);
+   query.bindValue(pos++, int(PageSize));
+   query.bindValue(pos, pageNumber * PageSize);
+   if (!query.exec()){
+      d_lastError = query.lastError();
+      // qDebug() << "QXSqlTreeModel::page failed:" << d_lastError.text();
+      return 0;}
+   siblings = new SiblingPage;
+   siblings->key = key;
+   siblings->nodes = &d_nodes;
+   siblings->ids.reserve(PageSize);
+   int columns = d_record.count();
+   int row = pageNumber * PageSize;
+   while (query.next()){
+      qint32 id = query.value(idCol()).toInt();
+      siblings->ids << id;
+      for (int c(0); c < columns; ++c) siblings->values << query.value(c);
+      NodeInfo info;
+      info.parentId = parentId;
+      info.row = row++;
+      d_nodes.insert(id, info);}
+   query.finish();
+   d_pages.insert(key, siblings);     // cost 1 per page, cacheSize >= 1 ensures it is kept
+   return siblings;}
+
+/* Position of the record id: from the cached pages, or else its parent and its row are queried and its page is
+   fetched again, as views keep indexes of records whose page was discarded meanwhile. Returns false if the record is
+   not in the table (anymore). */
+bool QXSqlTreeModel::node(qint32 id, NodeInfo& info) const {
+   QHash<qint32, NodeInfo>::const_iterator iter = d_nodes.constFind(id);
+   if (iter != d_nodes.constEnd()){
+      info = iter.value();
+      return true;}
+   if (!d_selected) return false;
+   d_parentQuery.bindValue(0, id);
+   if (!d_parentQuery.exec()) d_lastError = d_parentQuery.lastError();
+   bool found = d_parentQuery.next();
+   QVariant parentIdVariant = found ? d_parentQuery.value(0) : QVariant();
+   d_parentQuery.finish();
+   if (!found) return false;
+   info.parentId = (parentIdVariant.isNull() || parentIdVariant.toString().isEmpty()) ? 0 : parentIdVariant.toInt();
+   QSqlQuery& query = (info.parentId == 0) ? d_rootRowQuery : d_rowQuery;
+   int pos(0);
+   if (info.parentId != 0) query.bindValue(pos++, info.parentId);
+   query.bindValue(pos, id);
+   found = query.exec() && query.next();
+   if (found) info.row = query.value(0).toInt();
+   else d_lastError = query.lastError();
+   query.finish();
+   if (found) page(info.parentId, info.row / PageSize);     // keeps the positions of the siblings, too
+   return found;}
+
+// removes the positions of the records of the page, unless they belong to a page fetched later (table changed)
+QXSqlTreeModel::SiblingPage::~SiblingPage(){
+   for (int i(0); i < ids.count(); ++i){
+      QHash<qint32, NodeInfo>::iterator iter = nodes->find(ids.at(i));
+      if (iter != nodes->end() && iter.value().parentId == key.first && iter.value().row / PageSize == key.second) nodes->erase(iter);}}
@@ -0,0 +1,81 @@
+#ifndef QXSQLTREEMODEL_H
+#define QXSQLTREEMODEL_H
+
+#include <QAbstractItemModel>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QCache>
+#include <QHash>
+#include <QPair>
+#include <QVector>
+
+class QXSqlTreeModel : public QAbstractItemModel{
+   Q_OBJECT
+   Q_PROPERTY(int idCol READ idCol WRITE setIdCol)
+   Q_PROPERTY(int parentCol READ parentCol WRITE setParentCol)
+   Q_PROPERTY(int cacheSize READ cacheSize WRITE setCacheSize)
+   Q_PROPERTY(bool createParentIndex READ createParentIndex WRITE setCreateParentIndex)
+public:
+   QXSqlTreeModel(QObject* parent = 0, QSqlDatabase db = QSqlDatabase());
+   ~QXSqlTreeModel();
+   QSqlDatabase database() const;
+   QString tableName() const;
+   void setTable(const QString& tableName);
+   int idCol() const;
+   bool setIdCol(unsigned int col);
+   int parentCol() const;
+   bool setParentCol(unsigned int col);
+   int cacheSize() const;
+   void setCacheSize(int pages);
+   bool createParentIndex() const;
+   void setCreateParentIndex(bool enable);
+   bool select();
+   QSqlError lastError() const;
+   QModelIndex index(int row, int column, const QModelIndex& parent = QModelIndex()) const;
+   QModelIndex parent(const QModelIndex& child) const;
+   bool hasChildren(const QModelIndex& parent = QModelIndex()) const;
+   int rowCount(const QModelIndex& parent = QModelIndex()) const;
+   int columnCount(const QModelIndex& parent = QModelIndex()) const;
+   QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const;
+   QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const;
+   Qt::ItemFlags flags(const QModelIndex& index) const;
+private:
+   Q_DISABLE_COPY(QXSqlTreeModel)
+   enum {PageSize = 256};                          // siblings fetched per query
+   typedef QPair<qint32, int> PageKey;             // parent id and page number within its children
+   struct NodeInfo{
+      qint32 parentId;
+      int row;};                                   // row among the siblings
+   struct SiblingPage{
+      PageKey key;
+      QVector<qint32> ids;
+      QVector<QVariant> values;                    // row-major, columnCount() values per sibling
+      QHash<qint32, NodeInfo>* nodes;              // the entries of ids are removed as the page is discarded
+      ~SiblingPage();};
+   QSqlDatabase d_db;
+   QString d_tableName;
+   QSqlRecord d_record;                            // fields of the table, in column order
+   int idColumn;
+   int parentColumn;
+   bool d_selected;
+   bool d_createParentIndex;
+   mutable QSqlError d_lastError;
+   mutable QSqlQuery d_pageQuery;                  // prepared statements, see select()
+   mutable QSqlQuery d_rootPageQuery;
+   mutable QSqlQuery d_countQuery;
+   mutable QSqlQuery d_rootCountQuery;
+   mutable QSqlQuery d_parentQuery;                // parent and row of a record whose page was discarded, see node()
+   mutable QSqlQuery d_rowQuery;
+   mutable QSqlQuery d_rootRowQuery;
+   mutable QCache<PageKey, SiblingPage> d_pages;   // LRU of fetched sibling pages
+   mutable QHash<qint32, int> d_childCount;        // number of children of each parent id asked for
+   mutable QHash<qint32, NodeInfo> d_nodes;        // position of each id in the cached pages
+   void clearCaches();
+   const SiblingPage* page(qint32 parentId, int pageNumber) const;
+   bool node(qint32 id, NodeInfo& info) const;
+   int childCount(qint32 parentId) const;
+   qint32 getId(const QModelIndex& index) const;};
+
+#endif // QXSQLTREEMODEL_H
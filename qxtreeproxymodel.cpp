@@ -2,6 +2,10 @@
 #include <QAbstractTableModel>
 #include <QSqlRelationalTableModel>
 #include <QSqlTableModel>
+#include <QSqlDatabase>
+#include <QSqlDriver>
+#include <QSqlQuery>
+#include <QSqlRecord>
 #include <qdebug.h>
 #include <boost/cast.hpp>
 #include <QSortFilterProxyModel>
@@ -11,6 +15,10 @@
 #include <QTimer>
 #include <limits>
 #include <QFont>
+#include <QThread>
+#include <QAtomicInt>
+#include <QtConcurrentRun>
+#include <QFuture>
 
 
 /*!
@@ -36,6 +44,7 @@
   that errors in the database structure lead to Q_ASSERT failures as these can be prevented by the programmer; errors
   due to content of the database should lead to exceptions as these errors could be introduced by the end user, thus, the
   programmer should get a chance to catch them.
+  Violations present when the tree is built (duplicate ids, orphans, cycles, invalid rows) are listed by integrityReport().
 
   The source model, the id column index and the parent column index need to be set (see setter functions for detailed
   requirements). The tree is built such that the value (e.g., 123) in the parent field of row A determines
@@ -59,7 +68,9 @@ const char treeproxymime[] = "application/x-qxtreeproxymodeldatalist";
 
   The parameter parent is forwarded to QAbstractProxyModel from which this class is derived.
 */
-QXTreeProxyModel::QXTreeProxyModel(QObject *parent) : QAbstractProxyModel(parent), lastInsertedId(0), idColumn(-1), parentColumn(-1) {
+QXTreeProxyModel::QXTreeProxyModel(QObject *parent) : QAbstractProxyModel(parent), lastInsertedId(0), idColumn(-1), parentColumn(-1), d_buildCount(0), d_rowsResetPending(false),
+   d_insertedFirstRow(-1), d_insertedLastRow(-1), d_builder(0), d_asyncBuild(false), d_buildRestart(false),
+   d_cacheColumnFlags(false), d_lazyFetching(false), d_childCountsRead(false), d_childCountsValid(false), d_nextFreeId(1) {
    }
 
 /*!
@@ -67,7 +78,8 @@ QXTreeProxyModel::QXTreeProxyModel(QObject *parent) : QAbstractProxyModel(parent
 
   Frees resources (none needed to be freed from QXTreeproxyModel itself, possibly from inherited classes)
 */
-QXTreeProxyModel::~QXTreeProxyModel(){}
+QXTreeProxyModel::~QXTreeProxyModel(){
+   cancelBuild();}
 
 // getters and setters
 
@@ -104,7 +116,11 @@ int QXTreeProxyModel::idCol() const {
 */
 bool QXTreeProxyModel::setIdCol(unsigned int col){
    int iCol(boost::numeric_cast<int>(col));
+   if (iCol == idColumn) return true;
+   beginResetModel();
    idColumn = iCol;
+   resetIndex();     // index is keyed by the content of the id column
+   endResetModel();
    return true;}
 
 /*!
@@ -127,9 +143,79 @@ int QXTreeProxyModel::parentCol() const {
 */
 bool QXTreeProxyModel::setParentCol(unsigned int col){
    int pCol(boost::numeric_cast<int>(col));
+   if (pCol == parentColumn) return true;
+   beginResetModel();
    parentColumn = pCol;
+   resetIndex();     // child lists are keyed by the content of the parent column
+   endResetModel();
    return true;}
 
+/*!
+  \property QXTreeProxyModel::cacheColumnFlags
+  \brief whether flags() asks the source model only once per column
+
+  Views call flags() for every visible cell whenever they repaint. Most source models, in particular the SQL models,
+  decide editability per column and not per record; for these, enabling this property saves the mapping of each
+  index to the source model. The cached flags are discarded whenever the horizontal header data or the columns of the
+  source model change. Rows with a pending deletion are always passed on to the source model.
+
+  Default is false, i.e., the source model is asked for every index.
+*/
+/*!
+  \brief getter function
+
+  \sa cacheColumnFlags
+*/
+bool QXTreeProxyModel::cacheColumnFlags() const {
+   return d_cacheColumnFlags;}
+
+/*!
+  \brief setter function
+
+  \sa cacheColumnFlags
+*/
+void QXTreeProxyModel::setCacheColumnFlags(bool enable){
+   d_cacheColumnFlags = enable;
+   d_columnFlags.clear();}
+
+/*!
+  \property QXTreeProxyModel::lazyFetching
+  \brief whether the children of an item are fetched from the source model only when the item is expanded
+
+  The proxy model can only show records that the source model has already fetched; QSqlTableModel fetches its rows
+  in chunks, thus records deep in the table are only shown once all records in front of them are fetched. If this
+  property is true, the children of an item are fetched on demand: canFetchMore() is true for an item if the source
+  model has fewer of its children loaded than there are in the database, and fetchMore() lets the source model fetch
+  chunks until all of them are loaded. This is not a query per item: the source model fetches its rows in table order
+  only, thus expanding an item loads all rows in front of its last child, up to the whole table for an item whose
+  children are near its end. Compared with fetching everything up front, it only saves loading the rows behind the
+  deepest child expanded so far. hasChildren() is also true for items whose children are not yet fetched, thus items
+  show their expand indicator before their children are loaded.
+
+  The children in the database are counted for all items at once by a single grouped query on the table, the database
+  and the filter of the source model, which is repeated when the source model is re-populated; it is therefore only
+  available for a QSqlTableModel (or a derived class) as source model. For other source models items can fetch more as
+  long as the source model has more rows, and fetchMore() then fetches everything.
+
+  Default is false, i.e., only the root item fetches more rows, as inherited from the source model.
+*/
+/*!
+  \brief getter function
+
+  \sa lazyFetching
+*/
+bool QXTreeProxyModel::lazyFetching() const {
+   return d_lazyFetching;}
+
+/*!
+  \brief setter function
+
+  \sa lazyFetching
+*/
+void QXTreeProxyModel::setLazyFetching(bool enable){
+   d_lazyFetching = enable;
+   clearExpectedChildCounts();}
+
 /*!
   \brief setter function for sourceModel (reimplemented)
 
@@ -196,6 +282,9 @@ void QXTreeProxyModel::setSourceModel(QAbstractItemModel* newSourceModel){
    ok = connect(sourceModel(), SIGNAL(modelReset()), this, SLOT(sourceReset()));
    Q_ASSERT(ok);
    //reset();
+   d_columnFlags.clear();
+   d_relationKeys.clear();
+   resetIndex();
    emit endResetModel();}
 
 // reimplemented virtual functions (basic set)
@@ -221,41 +310,13 @@ QModelIndex QXTreeProxyModel::mapFromSource(const QModelIndex& sourceIndex) cons
    Q_ASSERT(sourceModel());
    Q_ASSERT(sourceIndex.isValid());
    // qDebug() << "mapFromSource" << sourceIndex;
-   QModelIndex proxyIndex;
-   if (sourceIndex.row() < 0) exit(99); //proxyIndex = QModelIndex();
-   else {
-      QModelIndex idx = sourceModel()->index(sourceIndex.row(), idCol());
-      Q_ASSERT(idx.isValid());
-      QVariant recordIdVariant = sourceModel()->data(idx, Qt::DisplayRole);
-      idx = sourceModel()->index(sourceIndex.row(), parentCol());
-      Q_ASSERT(idx.isValid());
-      if (/*recordParentVariant.toInt() != std::numeric_limits<qint32>::min() && */ recordIdVariant.isValid()){
-         bool ok;
-         qint32 recordId = recordIdVariant.toInt(&ok);
-         if (!ok) throw EXDatabase(QLatin1String("no int value in id column"), 0);
-         Q_ASSERT_X(ok, "sourceModel()->data conversion to int", qPrintable(sourceModel()->data(idx, Qt::DisplayRole).toString()));
-         Q_ASSERT(recordId != 0);
-         QVariant parentIdVariant = sourceModel()->data(sourceModel()->index(sourceIndex.row(), parentCol()), Qt::DisplayRole);
-         qint32 parentId;
-         if (parentIdVariant.isNull()) parentId = 0;     // not yet set??
-         else parentId = parentIdVariant.toInt(&ok);
-         Q_ASSERT_X(ok, QString::number(recordId).toLocal8Bit(), sourceModel()->data(sourceModel()->index(sourceIndex.row(), parentCol()), Qt::DisplayRole).toByteArray());
-         if (!ok) throw EXDatabase(QLatin1String("no int value in parent column"), recordId);
-         int rowNumber = rowFromId(recordId, parentId);
-         // find parent index of proxy index
-         QModelIndex parentIndex;
-         if (parentId == 0) parentIndex = QModelIndex();
-         else {     // need to recursively find parent index, as not yet 0
-            // qDebug() << "   entering recursion to find index with id" << parentId;
-            QModelIndex idx = sourceindexFromId(parentId);
-//            if (d_idFilterModel->rowCount() == 0) parentIndex = QModelIndex();    // id of requested parent not found -> assign to root
-//            else {
-            QModelIndex sourceParentIndex = idx.sibling(idx.row(), 0);      // parent is always first column
-            parentIndex = mapFromSource(sourceParentIndex);
-            Q_ASSERT_X(getId(parentIndex) == parentId, "wrong parentIndex found", qPrintable(QString::number(parentId)));}
-         proxyIndex = index(rowNumber, sourceIndex.column(), parentIndex);}
-      else proxyIndex = QModelIndex();}    // "none of my business" as id field of source index row is empty; most likely record not yet fully constructed
-   return proxyIndex;}
+   if (sourceIndex.row() < 0 || sourceIndex.row() >= d_index.idFromRow.count()) return QModelIndex();
+   qint32 recordId = d_index.idFromRow.at(sourceIndex.row());
+   // "none of my business" as id field of source index row is empty; most likely record not yet fully constructed
+   if (recordId == 0) return QModelIndex();
+   // orphans and records on a cycle are not part of the tree, although they have a position among their siblings
+   if (!isAttached(recordId)) return QModelIndex();
+   return proxyIndexFromId(recordId, sourceIndex.column());}
 
 /*!
   \brief reimplemented function
@@ -263,21 +324,27 @@ QModelIndex QXTreeProxyModel::mapFromSource(const QModelIndex& sourceIndex) cons
   This function \bold only re-implements the role == Qt::FontRole to strike out uncommitted record deletions.
   To change this behaviour re-implement this function for role == Qt::FontRole and return
   QAbstractProxyModel::data(proxyIndex, role) for all other roles.
+
+  Additionally, the roles SubtreeSizeRole and DepthRole return subtreeSize() and depth() of the record.
 */
 QVariant QXTreeProxyModel::data(const QModelIndex& proxyIndex, int role) const{
-   QVariant result = QAbstractProxyModel::data(proxyIndex, role);
-   if (role == Qt::FontRole){ // draw deleted (but not yet submitted) rows strike-through
-      QModelIndex sourceIndex = mapToSource(proxyIndex);
-      if (isSourceDeleted(sourceIndex)){
+   if (!sourceModel()) return QVariant();
+   if (role == SubtreeSizeRole) return proxyIndex.isValid() ? QVariant(subtreeSize(getId(proxyIndex))) : QVariant();
+   if (role == DepthRole) return proxyIndex.isValid() ? QVariant(depth(getId(proxyIndex))) : QVariant();
+   QModelIndex sourceIndex = mapToSource(proxyIndex);         // same as QAbstractProxyModel::data, but mapped only once
+   QVariant result = sourceModel()->data(sourceIndex, role);
+   if (role != Qt::FontRole || !isSourceDeleted(sourceIndex)) return result;
+   // draw deleted (but not yet submitted) rows strike-through
+   // qDebug() << proxyIndex << "is deleted";
+   if (result.isNull()){
+      if (d_strikeOutFont.isNull()){
          QFont myFont;
-         // qDebug() << proxyIndex << "is deleted";
-         if (result.isNull()) myFont = QFont();    // redundant
-         else {
-            myFont = result.value<QFont>();
-            Q_ASSERT(myFont != QFont());}
          myFont.setStrikeOut(true);
-         result = myFont;}}
-   return result;}
+         d_strikeOutFont = myFont;}
+      return d_strikeOutFont;}
+   QFont myFont = result.value<QFont>();
+   myFont.setStrikeOut(true);
+   return myFont;}
 
 /*!
   \brief reimplemented function
@@ -291,20 +358,12 @@ QModelIndex QXTreeProxyModel::index(int row, int column, const QModelIndex& pare
    // if (row < 0) return QModelIndex();
    // if (column < 0) return QModelIndex();
    if (parent.column() != 0 && parent.isValid()) return QModelIndex();
-   QModelIndexList idxList = sourcechildrenFromId(getId(parent));
-   // qDebug() << "   parent filter" << d_parentFilterModel->filterRegExp().pattern() << "returns" << d_parentFilterModel->rowCount() << "rows";
-   // qDebug() << idxList;
-   Q_ASSERT_X(idxList.count() > row, "too few children found",
+   const QVector<qint32>& children = childIds(getId(parent));
+   Q_ASSERT_X(children.count() > row, "too few children found",
               qPrintable(QString(QLatin1String("expected >%1, found %2 rows when filtering %3 for %4 in column %5"))
-                         .arg(row).arg(idxList.count()).arg(sourceModel()->objectName()).arg(getId(parent)).arg(parentCol())));
-   QModelIndex sourceParentIndex(idxList.at(row));
-   Q_ASSERT(sourceParentIndex.isValid());
-   QModelIndex sourceIdIndex = sourceParentIndex.sibling(sourceParentIndex.row(), idCol());
-   Q_ASSERT(sourceIdIndex.isValid());
-   bool ok;
-   int recordId = sourceModel()->data(sourceIdIndex, Qt::DisplayRole).toInt(&ok);
-   Q_ASSERT_X(ok, qPrintable(QString(QLatin1String("id in sourceModel with row = %1, col = %2")).arg(row).arg(idCol())),
-                  qPrintable(sourceModel()->data(idxList.at(row).sibling(row, idCol()), Qt::DisplayRole).toString()));
+                         .arg(row).arg(children.count()).arg(sourceModel()->objectName()).arg(getId(parent)).arg(parentCol())));
+   if (row >= children.count()) return QModelIndex();
+   qint32 recordId = children.at(row);
    Q_ASSERT(recordId != 0);
    QModelIndex newIndex = createIndex(row, column, recordId);
    // qDebug() << "index for" << row << column << parent << "is" << newIndex;
@@ -314,9 +373,134 @@ QModelIndex QXTreeProxyModel::index(int row, int column, const QModelIndex& pare
   \brief reimplemented function
 */
 bool QXTreeProxyModel::hasChildren(const QModelIndex &parent) const{
-   // to improve performance: do not count children
    // qDebug() << "hasChildren" << parent;
-   return (rowCount(parent) > 0);}
+   // asked for every visible row to draw the branch indicator: test the child list of the index, do not count
+   if (parent.isValid() && parent.column() != 0) return false;   // AQP: only first column is parent in tree model
+   qint32 parentId = getId(parent);
+   if (!childIds(parentId).isEmpty()) return true;
+   // children not yet fetched: counted for all items at once, see readChildCounts()
+   return d_lazyFetching && sourceModel()->canFetchMore(QModelIndex()) && expectedChildCount(parentId) != 0;}
+
+/*!
+  \property QXTreeProxyModel::asyncBuild
+  \brief whether the tree is built on a worker thread when the content of the source model is replaced
+
+  Whenever the source model is set or reset, or re-populated entirely (e.g., by QSqlTableModel::select()), the id
+  and parent columns are read and the tree is built from them. For tables with millions of rows, building the tree
+  blocks the GUI noticeably. If this property is true, the columns are copied (on the GUI thread, as models must only
+  be accessed from their thread), the tree is built on a worker thread, and the model remains empty until it is done.
+  Then the tree is shown by a single model reset. This includes layout changes of the source model, e.g. by sorting:
+  they are forwarded as layout change that removes all items, followed by a reset and a build on the worker thread,
+  thus persistent indexes and the expansion state of views are lost. While building, buildProgress() is emitted repeatedly, and
+  buildFinished() at the end. Changes of the source model during the build restart it.
+
+  Either way, tables of 262144 rows or more are built by QtConcurrent in QThread::idealThreadCount() parts: the id
+  and parent columns are split into contiguous row ranges, and the lookup tables into 64 shards by record id, each
+  shard filled by a single thread. Subtree sizes and depths are measured in parallel only across the children of the
+  root, thus a tree whose records mostly belong to one top-level branch measures it on one thread.
+
+  Default is false, i.e., the tree is built synchronously.
+*/
+/*!
+  \brief getter function
+
+  \sa asyncBuild
+*/
+bool QXTreeProxyModel::asyncBuild() const {
+   return d_asyncBuild;}
+
+/*!
+  \brief setter function
+
+  \sa asyncBuild
+*/
+void QXTreeProxyModel::setAsyncBuild(bool enable){
+   d_asyncBuild = enable;}
+
+/*!
+  \brief returns true while the tree is built on a worker thread
+
+  \sa asyncBuild
+*/
+bool QXTreeProxyModel::isBuilding() const {
+   return d_builder != 0;}
+
+/*!
+  \fn void QXTreeProxyModel::buildProgress(int rows, int totalRows)
+  \brief emitted while the tree is built on a worker thread, rows of totalRows are done
+
+  \sa asyncBuild
+*/
+/*!
+  \fn void QXTreeProxyModel::buildFinished()
+  \brief emitted when the tree that was built on a worker thread is shown
+
+  \sa asyncBuild
+*/
+/*!
+  \brief returns the violations of the requirements on the source model found when the tree was built
+
+  The tree is built in a single pass over the id and parent columns whenever the source model, idCol, parentCol or
+  the entire content of the source model changes (e.g., by QSqlTableModel::select()). Records that violate the
+  requirements (see class description) are not shown; this report lists them. It is not updated by later edits.
+*/
+QXTreeProxyModel::IntegrityReport QXTreeProxyModel::integrityReport() const {
+   return d_integrityReport;}
+
+/*!
+  \brief returns the number of records in the branch of record id, including the record itself
+
+  For id 0 (the invisible root item) this is the number of all records in the tree. Records that are not part of the
+  tree (e.g., with an invalid parent) have a subtree size of 0. The size is also available as SubtreeSizeRole of
+  data().
+
+  The sizes and depths of all records are computed when the tree is built and kept up to date afterwards: inserting,
+  removing or moving a record updates the sizes of its ancestors (O(depth)), and a move updates the depths within the
+  moved branch only. dataChanged() is emitted for the records whose size or depth changed. This function is O(1).
+*/
+int QXTreeProxyModel::subtreeSize(qint32 id) const {
+   return d_index.sizeFromId.value(id, 0);}
+
+/*!
+  \brief returns the number of ancestors of record id
+
+  First level records have depth 0, the invisible root item (id 0) and records that are not part of the tree have
+  depth -1. The depth is also available as DepthRole of data().
+
+  \sa subtreeSize()
+*/
+int QXTreeProxyModel::depth(qint32 id) const {
+   if (id == 0) return -1;
+   return d_index.depthFromId.value(id, -1);}
+
+/*!
+  \brief reimplemented function
+
+  \sa lazyFetching
+*/
+bool QXTreeProxyModel::canFetchMore(const QModelIndex& parent) const {
+   if (!d_lazyFetching) return QAbstractProxyModel::canFetchMore(parent);
+   if (parent.isValid() && parent.column() != 0) return false;
+   if (!sourceModel()->canFetchMore(QModelIndex())) return false;
+   qint32 parentId = getId(parent);
+   int expected = expectedChildCount(parentId);
+   return expected < 0 || childIds(parentId).count() < expected;}
+
+/*!
+  \brief reimplemented function
+
+  \sa lazyFetching
+*/
+void QXTreeProxyModel::fetchMore(const QModelIndex& parent){
+   if (!d_lazyFetching){
+      QAbstractProxyModel::fetchMore(parent);
+      return;}
+   // the source model fetches its rows in table order only, and a view only asks again if rows appear below the root
+   // or an expanded item: fetch chunks until all children of parent arrived (added to the tree by sourceRowsInserted)
+   int rows(-1);
+   while (canFetchMore(parent) && sourceModel()->rowCount(QModelIndex()) > rows){
+      rows = sourceModel()->rowCount(QModelIndex());
+      sourceModel()->fetchMore(QModelIndex());}}
 
 /*!
   \brief reimplemented function
@@ -326,9 +510,7 @@ int QXTreeProxyModel::rowCount(const QModelIndex& parent) const{
    int rows;
    if (parent.isValid() && parent.column() != 0) rows = 0;   // AQP: only first column is parent in tree model
 //   if (parent.column() != 0) rows = 0;    first asks for child count of root item, i.e., children of an invalid model index
-   else {
-      QModelIndexList idxList = sourcechildrenFromId(getId(parent));
-      rows = idxList.count();}
+   else rows = childIds(getId(parent)).count();
    // qDebug() << "   rowCount for " << parent << "with id" << getId(parent) << "returns" << rows;
    return rows;}
 
@@ -357,24 +539,16 @@ QModelIndex QXTreeProxyModel::parent(const QModelIndex& child) const{
    Q_ASSERT_X(childId != 0, "getId returned 0 for index",
               qPrintable(QString(QLatin1String("row %1, column %2, internalId %3, model address %4"))
                                        .arg(child.row()).arg(child.column()).arg(child.internalId()).arg((qlonglong)(void*)child.model())));
-   QModelIndex idx = sourceindexFromId(childId);
-   bool ok;
-   qint32 parentId = sourceModel()->data(idx.sibling(idx.row(), parentCol()), Qt::DisplayRole).toInt(&ok);
-   // if (!ok) parentId = 0;
-   Q_ASSERT_X(ok, "illegal parent", sourceModel()->data(idx, Qt::DisplayRole).toByteArray());
-   if (!ok) {
+   const QHash<qint32, qint32>& parents = d_index.parentFromId.shardFor(childId);
+   QHash<qint32, qint32>::const_iterator iter = parents.constFind(childId);
+   Q_ASSERT_X(iter != parents.constEnd(), "illegal parent", qPrintable(QString::number(childId)));
+   if (iter == parents.constEnd()) {
       EXDatabase exception;
       exception.msg = QLatin1String("illegal entry in parent field");
-      exception.id = getId(child);
+      exception.id = childId;
       throw exception;}
-   if (parentId == 0) return QModelIndex();
-   idx = sourceindexFromId(parentId);
-   QModelIndex sourceIndex = idx.sibling(idx.row(), 0); //AQP: all rows are child of parent's 1st column
-   Q_ASSERT_X(sourceModel()->data(sourceModel()->index(sourceIndex.row(), idCol())).toInt(&ok) == parentId && ok, "id at source",
-                           qPrintable(sourceModel()->data(sourceModel()->index(sourceIndex.row(), idCol())).toString()));
-   QModelIndex proxyIndex = mapFromSource(sourceIndex);
-   // qDebug() << "   parent() for parameter" << child << "with id" << getId(child) << "is" << sourceIndex << "," << proxyIndex << "and has id" << parentId;
-   Q_ASSERT_X(proxyIndex.internalId() == parentId, qPrintable(QString::number(parentId)), qPrintable(QString::number(proxyIndex.internalId())));
+   QModelIndex proxyIndex = proxyIndexFromId(iter.value(), 0);    //AQP: all rows are child of parent's 1st column
+   // qDebug() << "   parent() for parameter" << child << "with id" << getId(child) << "is" << proxyIndex << "and has id" << iter.value();
    return proxyIndex;}
 
 /*!
@@ -382,12 +556,10 @@ QModelIndex QXTreeProxyModel::parent(const QModelIndex& child) const{
 */
 Qt::ItemFlags QXTreeProxyModel::flags(const QModelIndex& index) const {
    Q_ASSERT(sourceModel());
-   Qt::ItemFlags result = QAbstractProxyModel::flags(index);
+   Qt::ItemFlags result = sourceFlags(index);
    // qDebug() << "preset flags for" << index << "=" << result;
    if (index.isValid()) result |= Qt::ItemIsEnabled | Qt::ItemIsSelectable;
    if (index.column() == 0) result |= Qt::ItemIsDragEnabled;
-   Qt::ItemFlags sourceFlags = sourceModel()->flags(mapToSource(index));
-   if (sourceFlags.testFlag(Qt::ItemIsEditable) && index.column() != -1) result |= Qt::ItemIsEditable;
    // qDebug() << "   source flags for" << index << "=" << result;
    // if (index.column() == idCol() || index.column() == parentCol()) result &= ~Qt::ItemIsEditable;
    result |= Qt::ItemIsDropEnabled;  // even invalid index = empty space, accepts dropped items
@@ -395,6 +567,60 @@ Qt::ItemFlags QXTreeProxyModel::flags(const QModelIndex& index) const {
    // BUG: only_toplevelitems_are_selectable when QTreeView has rowselection behaviour
    return result;}
 
+// flags of the source model for index, taken from the column cache if enabled
+Qt::ItemFlags QXTreeProxyModel::sourceFlags(const QModelIndex& index) const {
+   if (!d_cacheColumnFlags || !index.isValid()) return sourceModel()->flags(mapToSource(index));
+   if (d_index.deletedCount > 0){     // flags of a deleted row may differ from those of its column
+      QModelIndex sourceIndex = mapToSource(index);
+      if (isSourceDeleted(sourceIndex)) return sourceModel()->flags(sourceIndex);}
+   int column = index.column();
+   if (d_columnFlags.isEmpty()) d_columnFlags.fill(-1, sourceModel()->columnCount(QModelIndex()));
+   if (column >= d_columnFlags.count()) return sourceModel()->flags(mapToSource(index));
+   if (d_columnFlags.at(column) < 0) d_columnFlags[column] = sourceModel()->flags(mapToSource(index));
+   return Qt::ItemFlags(QFlag(d_columnFlags.at(column)));}
+
+/* Number of children of parentId in the database (not in the source model, which might not have fetched all of
+   them yet), or -1 if unknown. */
+int QXTreeProxyModel::expectedChildCount(qint32 parentId) const {
+   if (!d_childCountsRead) readChildCounts();
+   if (!d_childCountsValid) return -1;
+   return d_expectedChildCount.value(parentId, 0);}
+
+/* Counts the children of all parents by a single grouped query on the table, the database and the filter of the
+   source model, thus hasChildren() does not query the database per item. Parent fields that are NULL or empty count
+   for the root, as in sourceParentId(); the counts are cached until the source model is re-populated. */
+void QXTreeProxyModel::readChildCounts() const {
+   d_childCountsRead = true;
+   d_childCountsValid = false;
+   d_expectedChildCount.clear();
+   const QSqlTableModel* tableModel = qobject_cast<const QSqlTableModel*>(sourceModel());
+   if (!tableModel || parentCol() < 0) return;
+   QSqlDatabase db = tableModel->database();
+   QSqlDriver* driver = db.driver();
+   // field name from the table itself, as QSqlRelationalTableModel renames relation columns
+   QString parentField = driver->escapeIdentifier(db.record(tableModel->tableName()).fieldName(parentCol()), QSqlDriver::FieldName);
+   QString statement = QString(QLatin1String("SELECT %2, COUNT(*) FROM %1")).arg(driver->escapeIdentifier(tableModel->tableName(), QSqlDriver::TableName)).arg(parentField);
+   if (!tableModel->filter().isEmpty()) statement += QString(QLatin1String(" WHERE (%1)")).arg(tableModel->filter());
+   statement += QString(QLatin1String(" GROUP BY %1")).arg(parentField);
+   QSqlQuery query(db);
+   query.setForwardOnly(true);
+   if (!query.exec(statement)){
+      // qDebug() << "readChildCounts failed:" << query.lastError().text();
+      return;}
+   while (query.next()){
+      QVariant parentIdVariant = query.value(0);
+      qint32 parentId(0);
+      bool ok(true);
+      if (!parentIdVariant.isNull() && !parentIdVariant.toString().isEmpty()) parentId = parentIdVariant.toInt(&ok);
+      if (ok) d_expectedChildCount[parentId] += query.value(1).toInt();}
+   d_childCountsValid = true;}
+
+// forgets the counted children, e.g. as the source model or its filter changed
+void QXTreeProxyModel::clearExpectedChildCounts(){
+   d_expectedChildCount.clear();
+   d_childCountsRead = false;
+   d_childCountsValid = false;}
+
 // Drag and drop functionality
 /*!
   \brief reimplemented function
@@ -448,28 +674,20 @@ bool QXTreeProxyModel::dropMimeData(const QMimeData *mimedata, Qt::DropAction ac
    // qDebug() << "   rows to drop:" << idList.count();
    bool ok(true);
    // check that not moved or copied to own child; do this prior to start moving to avoid that some rows are already moved
+   QSet<qint32> newParentIds = ancestorIds(getId(newParent));     // the ancestors are collected once for all dropped rows
    for(QList<qint32>::iterator iter= idList.begin(); ok && iter != idList.end(); ++iter){
-      QModelIndex sourceIndex = sourceindexFromId(*iter);
-      if (isSourceDeleted(sourceIndex)) *iter = 0;      //id 0 for deleted rows
-      QModelIndex proxyIndex = mapFromSource(sourceIndex);
-      Q_ASSERT(proxyIndex.isValid());
-      QModelIndex parentLine(newParent);           // do not drop on own child
-      while (ok && parentLine.isValid()){
-         ok = (parentLine != proxyIndex);
-         parentLine = parent(parentLine);}}
+      Q_ASSERT(d_index.positionFromId.contains(*iter));
+      if (isSourceDeleted(sourceindexFromId(*iter))) *iter = 0;      //id 0 for deleted rows
+      else ok = !newParentIds.contains(*iter);}                   // do not drop on own child
    if (!ok) return false;
-   foreach(qint32 id, idList) if (id != 0 && ok) {
-      switch (action){
-      case Qt::MoveAction:
-         ok = moveBranch(id, getId(newParent));
-         Q_ASSERT(ok);
-         break;
-      case Qt::CopyAction:
-        ok = copyBranch(id, getId(newParent));
-        Q_ASSERT(ok);
-         break;
-      default:
-         Q_ASSERT(false);}}
+   idList.removeAll(0);
+   if (action == Qt::CopyAction){      // all branches at once, thus an SQL source is re-populated once per drop
+      ok = copyBranches(idList, getId(newParent));
+      Q_ASSERT(ok);
+      return ok;}
+   foreach(qint32 id, idList) if (ok) {
+      ok = moveBranch(id, getId(newParent));
+      Q_ASSERT(ok);}
    return ok;}
 
 /*!
@@ -482,53 +700,45 @@ bool QXTreeProxyModel::moveBranch(qint32 id, qint32 newParent){
    // no need to move child nodes, as these remain attached to moved item
    QModelIndex idx = sourceindexFromId(id);
    // qDebug() << "moveBranch" << id << "to replace parent by" << newParent;
-   // no row move in source model, thus no need to call beginMoveRows(); modification of value in parent column will be communicated by source model
+   // no row move in source model, thus no need to call beginMoveRows() here; the modification of the value in the parent column
+   // is communicated by the source model and forwarded as row move by sourceDataChanged()
    if (!sourceModel()->setData(idx.sibling(idx.row(), parentCol()), newParent, Qt::EditRole)) return false;   // read-only sourceModel
    return true;}
 
+// copies the branches starting at ids to newParent, by a single transaction if the source model allows it
+bool QXTreeProxyModel::copyBranches(const QList<qint32>& ids, qint32 newParent){
+   if (ids.isEmpty()) return true;
+   QSqlTableModel* tableModel = sqlBranchSource();
+   if (tableModel && sqlCopyBranches(tableModel, ids, newParent)) return true;      // else copy row by row
+   bool ok(true);
+   for (QList<qint32>::const_iterator iter = ids.constBegin(); iter != ids.constEnd() && ok; ++iter) ok = copyBranch(*iter, newParent);
+   return ok;}
+
+// copies the branch starting at id to newParent row by row
 bool QXTreeProxyModel::copyBranch(qint32 id, qint32 newParent){
    // qDebug() << "copyBranch" << id << "to parent" << newParent;
-   if (!insertRow(0, QModelIndex())) return false;       // read-only sourceModel
    QModelIndex sourceIndex = sourceindexFromId(id);
    if (isSourceDeleted(sourceIndex)) return true;  //row is deleted but not yet submitted; needed for recurisve calls
+   QModelIndex newParentIndex = proxyIndexFromId(newParent);
+   if (!insertRow(rowCount(newParentIndex), newParentIndex)) return false;       // read-only sourceModel
    qint32 newId(lastInsertedId);
    QList<QVariant> dataToCopy;
    for (int c(0); c < sourceModel()->columnCount(QModelIndex()); ++c){
       dataToCopy << sourceModel()->data(sourceIndex.sibling(sourceIndex.row(), c), Qt::EditRole);
       if (dataToCopy.at(c).isValid()){
-         if (QSqlRelationalTableModel* relationalModel = qobject_cast<QSqlRelationalTableModel*>(sourceModel())){
-            QSqlRelation relation = relationalModel->relation(c);
-            if (relation.isValid()){
-               QSqlTableModel* relatedTable = relationalModel->relationModel(c);
-               int displayField = relatedTable->fieldIndex(relation.displayColumn());
-               int indexField = relatedTable->fieldIndex(relation.indexColumn());
-               QModelIndexList idxs = relatedTable->match(relatedTable->index(0, displayField), Qt::DisplayRole, dataToCopy.at(c));
-               if (idxs.count() == 1){
-                  QModelIndex idx = idxs.at(0);
-                  Q_ASSERT(idx.isValid());
-                  dataToCopy[c] =  relatedTable->data(relatedTable->index(idx.row(), indexField), Qt::DisplayRole);}
-               else if (idxs.count() == 0);  // assume that the value is a forgein key that occurs ij not yet commited records
-               else Q_ASSERT(false);}}}}
+         if (QSqlRelationalTableModel* relationalModel = qobject_cast<QSqlRelationalTableModel*>(sourceModel()))
+            dataToCopy[c] = relationKey(relationalModel, c, dataToCopy.at(c));}}
    // qDebug() << dataToCopy;
    Q_ASSERT_X(dataToCopy.at(idCol()).toInt() == id, (dataToCopy.at(idCol()).toString() + QLatin1String(" and ") + QString::number(id)).toLocal8Bit(), "should be identical");
    sourceIndex = sourceindexFromId(newId);
    bool ok(true);
    for (int c(0); c < sourceModel()->columnCount(QModelIndex()); ++c){
       if (c == idCol()) Q_ASSERT(sourceModel()->data(sourceIndex.sibling(sourceIndex.row(), c), Qt::DisplayRole).toInt(&ok) == newId);
-      else if (c == parentCol()) ok = sourceModel()->setData(sourceIndex.sibling(sourceIndex.row(), c), newParent, Qt::EditRole);
+      else if (c == parentCol()) Q_ASSERT(sourceModel()->data(sourceIndex.sibling(sourceIndex.row(), c), Qt::DisplayRole).toInt(&ok) == newParent);
       else ok = sourceModel()->setData(sourceIndex.sibling(sourceIndex.row(), c), dataToCopy.at(c), Qt::EditRole);
       Q_ASSERT(ok);}
-   QModelIndexList childIndices = sourcechildrenFromId(id);
-   QSet<qint32> childIds;
-   foreach (QModelIndex idx, childIndices) {
-      qint32 childId(sourceModel()->data(idx, Qt::DisplayRole).toInt(&ok));
-      Q_ASSERT(ok && childId != 0);
-      childIds.insert(childId);}
-   if (childIndices.count() != childIds.count()){
-      EXDatabase exception;
-      exception.msg = QLatin1String("children have duplicate id");
-      exception.id = id;}
-   if (childIds.count() > 0) for (QSet<qint32>::const_iterator iter = childIds.constBegin(); iter != childIds.constEnd() && ok; ++iter){
+   QVector<qint32> children = childIds(id);      // copy, as the index changes while copying
+   for (QVector<qint32>::const_iterator iter = children.constBegin(); iter != children.constEnd() && ok; ++iter){
       ok = copyBranch(*iter, newId);
       Q_ASSERT(ok);}
    return ok;}
@@ -540,26 +750,30 @@ bool QXTreeProxyModel::copyBranch(qint32 id, qint32 newParent){
 bool QXTreeProxyModel::removeRows(int row, int count, const QModelIndex& parent){
    Q_ASSERT(sourceModel());
    if (count == 0) return true;
-   bool ok;
    QList<qint32> ids;
-   for (int i(0); i < count; ++i) {
-      QModelIndex proxyIndex = index(row + i, 0, parent);
-      qint32 recordId = getId(proxyIndex);
-      Q_ASSERT(recordId != 0);
-      ids.append(recordId);}
+   const QVector<qint32>& siblings = childIds(getId(parent));
+   for (int i(0); i < count && row + i < siblings.count(); ++i) ids.append(siblings.at(row + i));
    Q_ASSERT(ids.count() > 0 && ids.count() <= count);
    // qDebug() << "remove" << ids.count() << "sibling rows:" << ids;
-//   beginRemoveRows(parent, row, row + count - 1);
-   foreach(qint32 recordId, ids){
-      QModelIndex sourceIndex = sourceindexFromId(recordId);
-      // qDebug() << "removing item" << recordId << "with column(0) =" << sourceModel()->data(sourceIndex.sibling(sourceIndex.row(), 0));
-      ok = sourceModel()->removeRow(sourceIndex.row(), QModelIndex());
-      if (!ok) {
-         EXDatabase exception;
-         exception.msg = QLatin1String("can not remove record");
-         exception.id = recordId;}
-      removeChildRows(recordId);}
-//   endRemoveRows();
+   QSqlTableModel* tableModel = sqlBranchSource();
+   if (tableModel && sqlRemoveBranches(tableModel, ids)) return true;            // else remove row by row
+   // remove the records of all branches as contiguous ranges of source rows, from the highest to the lowest row
+   QList<QPair<int, qint32> > rows;     // source row and id of each record
+   foreach (qint32 id, branchIds(ids)) rows << qMakePair(d_index.rowFromId.value(id), id);
+   qSort(rows);
+   bool ok(true);
+   while (ok && !rows.isEmpty()){
+      int first(rows.count() - 1);
+      while (first > 0 && rows.at(first - 1).first == rows.at(first).first - 1) --first;
+      int builds(d_buildCount);
+      ok = sourceModel()->removeRows(rows.at(first).first, rows.last().first - rows.at(first).first + 1, QModelIndex());
+      while (rows.count() > first) rows.removeLast();
+      if (builds != d_buildCount){    // source model was re-populated (e.g., QSqlTableModel::select()), thus row numbers changed
+         QList<QPair<int, qint32> > remainingRows;
+         for (int i(0); i < rows.count(); ++i) if (d_index.rowFromId.contains(rows.at(i).second))
+            remainingRows << qMakePair(d_index.rowFromId.value(rows.at(i).second), rows.at(i).second);
+         qSort(remainingRows);
+         rows = remainingRows;}}
    return ok;}
 
 /*!
@@ -572,11 +786,46 @@ bool QXTreeProxyModel::insertRows(int row, int count, const QModelIndex& parent)
    // qDebug() << "insert" << count << "rows" << "to parent" << parent;
    if (count == 0) return true;
    qint32 parentId = getId(parent);
-   for (int i(0); i < count; ++i){
-      bool ok = sourceModel()->insertRow(0, QModelIndex());
-      if (!ok) return false;  // likely a read-only sourceModel
-      QModelIndex idx = sourceModel()->index(0, idCol());
+   // insert all rows by a single call; some source models only insert one row at a time (e.g., QSqlTableModel
+   // with OnFieldChange or OnRowChange strategy), then fall back to single row insertion
+   int batchSize(count);
+   int inserted(0);
+   while (inserted < count){
+      d_insertedFirstRow = -1;
+      // append: inserting in front would shift all source rows, and the proxy does not depend on the source row order
+      if (!sourceModel()->insertRows(sourceModel()->rowCount(QModelIndex()), batchSize, QModelIndex())){
+         if (batchSize == 1) return false;  // likely a read-only sourceModel
+         batchSize = 1;
+         continue;}
+      if (d_insertedFirstRow < 0) return false;     // rowsInserted() not received, e.g. while the index is built
+      Q_ASSERT_X(d_insertedLastRow - d_insertedFirstRow + 1 == batchSize, "insertRows", "rowsInserted() for other rows");
+      if (!initInsertedRows(d_insertedFirstRow, d_insertedLastRow, parentId)) return false;
+      inserted += batchSize;
+      batchSize = qMin(batchSize, count - inserted);}
+   return true;}
+
+/* Fills freshly inserted source rows in a single pass and submits them at once. The parent field is written before
+   the id field, thus each record shows up directly below its final parent. Only if no id is known prior to submit()
+   (e.g., autoincrement at database level), the parent field is temporarily tagged to find the record afterwards. */
+bool QXTreeProxyModel::initInsertedRows(int firstSourceRow, int lastSourceRow, qint32 parentId){
+   const qint32 tag = std::numeric_limits<qint32>::min();
+   bool ok(true);
+   bool idsKnown(true);
+   QList<qint32> insertedIds;
+   int idsNeeded(0);      // ids not provided otherwise are reserved as one block
+   for (int r(firstSourceRow); r <= lastSourceRow; ++r)
+      if (sourceModel()->data(sourceModel()->index(r, idCol()), Qt::DisplayRole).toInt() == 0 && !d_defaultValues.value(idCol()).isValid()) ++idsNeeded;
+   qint32 nextId = (idsNeeded > 0) ? reserveIds(idsNeeded) : 0;
+   for (int r(firstSourceRow); r <= lastSourceRow; ++r){
+      QModelIndex idx = sourceModel()->index(r, idCol());
       Q_ASSERT(idx.isValid());
+      qint32 newId = sourceModel()->data(idx, Qt::DisplayRole).toInt();   // already filled by primeInsert or derived sourceModel class or ...
+      if (newId != 0);
+      else if (d_defaultValues.value(idCol()).isValid()) newId = d_defaultValues.at(idCol()).toInt();  // use provided value
+      else if (nextId != 0) newId = nextId++;                                                       // use homebrewn autoincrement
+      idsKnown = idsKnown && (newId != 0);
+      insertedIds << newId;
+      ok = sourceModel()->setData(sourceModel()->index(r, parentCol()), newId != 0 ? parentId : tag, Qt::EditRole);
       Q_ASSERT(ok);
       for (int c(0); c < sourceModel()->columnCount(QModelIndex()); ++c){
 #ifndef QT_NO_DEBUG_OUTPUT
@@ -584,35 +833,30 @@ bool QXTreeProxyModel::insertRows(int row, int count, const QModelIndex& parent)
             QSqlRelation relation = relationalModel->relation(c);
             if (relation.isValid()) Q_ASSERT(d_defaultValues.value(c).isValid());}  // need to fill relation column, otherwise insertRows() fails
 #endif
-         idx = sourceModel()->index(0, c);
+         if (c == idCol() || c == parentCol()) continue;
+         idx = sourceModel()->index(r, c);
          Q_ASSERT(idx.isValid());
          // qDebug() << "freshly inserted field" << idx << sourceModel()->data(idx, Qt::DisplayRole);
-         if (c == idCol()){            // set id column
-            if (sourceModel()->data(idx, Qt::DisplayRole).toInt() != 0);       // already filled by primeInsert or derived sourceModel class or ...
-            else if (d_defaultValues.value(c).isValid()) ok = sourceModel()->setData(idx, d_defaultValues.at(c), Qt::EditRole);  // use provided value
-            else ok = sourceModel()->setData(idx, nextFreeId(), Qt::EditRole);}                                                  // use homebrewn autoincrement
-         else if (c == parentCol()) ok = sourceModel()->setData(idx, std::numeric_limits<qint32>::min(), Qt::EditRole); // temporary marker to identify row
-         else if (d_defaultValues.value(c).isValid()) ok = sourceModel()->setData(idx, d_defaultValues.at(c), Qt::EditRole);
+         if (d_defaultValues.value(c).isValid()) ok = sourceModel()->setData(idx, d_defaultValues.at(c), Qt::EditRole);
          // qDebug() << "   modified to" << idx << sourceModel()->data(idx, Qt::DisplayRole);
          Q_ASSERT(ok);}
-      ok = (sourceModel()->data(sourceModel()->index(0, idCol())).toInt() != 0);    // needed to judge result of submit(); which in turn might change id)
-      ok = (sourceModel()->submit() || ok);
-      Q_ASSERT_X(ok, "submit() failed and no valid id was set previously", "is the edit strategy erroneously OnManualSubmit combined with autoincrement at database level?");
-      // qDebug() << "sourceModel has" << sourceModel()->rowCount() << "rows and" << sourceModel()->columnCount() << "columns;";
-      /* assert for row count incorrectly fails if un-submitted row deletions are in the source model
-      Q_ASSERT_X(sourceModel()->rowCount() == oldRowCount + 1, "row inserted?",
-                 QString(QLatin1String("old row count %1, new %2")).arg(oldRowCount).arg(sourceModel()->rowCount()).toLocal8Bit()); */
-      QModelIndexList idxList = sourcechildrenFromId(std::numeric_limits<qint32>::min());
-      Q_ASSERT_X(idxList.count() == 1, "row count for tag in parent column should be 1", QString::number(idxList.count()).toLatin1());
-      lastInsertedId = sourceModel()->data(idxList.at(0), Qt::DisplayRole).toInt(&ok);
-      Q_ASSERT_X(ok, "lastInsertedId", sourceModel()->data(idxList.at(0), Qt::DisplayRole).toByteArray());
-      Q_ASSERT(lastInsertedId != 0);
-      QModelIndex filterIndex = idxList.at(0).sibling(idxList.at(0).row(), parentCol());
-      // qDebug() << "lastInserted" << lastInsertedId << "old parent" << sourceModel()->data(filterIndex, Qt::DisplayRole) << "new parent" << parentId;
-      ok = sourceModel()->setData(filterIndex, QVariant(parentId), Qt::EditRole);
-      // qDebug() << "   set parent" << sourceModel()->data(filterIndex, Qt::DisplayRole);
+      idx = sourceModel()->index(r, idCol());
+      if (newId != 0 && sourceModel()->data(idx, Qt::DisplayRole).toInt() != newId) ok = sourceModel()->setData(idx, newId, Qt::EditRole);
       Q_ASSERT(ok);}
-   return true;}
+   ok = (sourceModel()->submit() || idsKnown);     // submit() might change rows and ids
+   Q_ASSERT_X(ok, "submit() failed and no valid id was set previously", "is the edit strategy erroneously OnManualSubmit combined with autoincrement at database level?");
+   if (!ok) return false;
+   lastInsertedId = insertedIds.last();
+   if (idsKnown) return true;
+   QVector<qint32> tagged = childIds(tag);     // copy, as setting the parent changes the index
+   Q_ASSERT_X(tagged.count() == insertedIds.count(qint32(0)), "row count for tag in parent column", QString::number(tagged.count()).toLatin1());
+   foreach (qint32 id, tagged){
+      QModelIndex idx = sourceindexFromId(id);
+      // qDebug() << "lastInserted" << id << "old parent" << sourceModel()->data(idx.sibling(idx.row(), parentCol()), Qt::DisplayRole) << "new parent" << parentId;
+      ok = sourceModel()->setData(idx.sibling(idx.row(), parentCol()), QVariant(parentId), Qt::EditRole);
+      Q_ASSERT(ok);
+      lastInsertedId = id;}
+   return !tagged.isEmpty();}
 
 /*!
   \brief reimplemented function
@@ -658,97 +902,835 @@ qint32 QXTreeProxyModel::getId(const QModelIndex& idx) const{
    //qDebug() << "   id is" << id;
    return id;}
 
-void QXTreeProxyModel::removeChildRows(qint32 parentId){
-   Q_ASSERT(sourceModel());
-   QModelIndexList childIndices = sourcechildrenFromId(parentId);
-   foreach (QModelIndex childIndex, childIndices){
-      if (!isSourceDeleted(childIndex)){
-         // store id of this child to later remove it and its children
-         bool ok;
-         qint32 childId = sourceModel()->data(childIndex, Qt::DisplayRole).toInt(&ok);
-         Q_ASSERT(ok);
+/* Returns the source model if branches can be copied and removed by SQL statements on its table instead of row by row:
+   the source model must be a QSqlTableModel without filter on an SQLite database (which supports WITH RECURSIVE), and
+   must write changes to the database immediately, as the statements bypass the source model. Returns 0 otherwise. */
+QSqlTableModel* QXTreeProxyModel::sqlBranchSource() const {
+   QSqlTableModel* tableModel = qobject_cast<QSqlTableModel*>(sourceModel());
+   if (!tableModel || tableModel->editStrategy() == QSqlTableModel::OnManualSubmit || !tableModel->filter().isEmpty()) return 0;
+   QSqlDatabase db = tableModel->database();
+   if (!db.driverName().startsWith(QLatin1String("QSQLITE")) || !db.driver()->hasFeature(QSqlDriver::Transactions)) return 0;
+   return tableModel;}
+
+/* Copies the branches starting at ids (including all descendants) to newParent within one transaction: the ids of
+   each branch are numbered in a temporary table, mapped to a block of new ids and inserted by a single INSERT ...
+   SELECT. Each branch is copied on its own, as if dropped alone, even if it is part of another dropped branch. The
+   source model is re-populated once afterwards. Returns false if nothing was changed, e.g., if the SQLite version does
+   not support WITH RECURSIVE (before 3.8.3). */
+bool QXTreeProxyModel::sqlCopyBranches(QSqlTableModel* tableModel, const QList<qint32>& ids, qint32 newParent){
+   QSqlDatabase db = tableModel->database();
+   QSqlDriver* driver = db.driver();
+   QSqlRecord record = db.record(tableModel->tableName());
+   if (!tableModel->submit() || !db.transaction()) return false;      // submit a pending row, if any (OnRowChange)
+   QString table = driver->escapeIdentifier(tableModel->tableName(), QSqlDriver::TableName);
+   QString idField = driver->escapeIdentifier(record.fieldName(idCol()), QSqlDriver::FieldName);
+   QString parentField = driver->escapeIdentifier(record.fieldName(parentCol()), QSqlDriver::FieldName);
+   QStringList fields;
+   for (int c(0); c < record.count(); ++c) fields << driver->escapeIdentifier(record.fieldName(c), QSqlDriver::FieldName);
+   QSqlQuery query(db);
+   bool ok = query.exec(QLatin1String("CREATE TEMP TABLE IF NOT EXISTS QXTreeCopy (Seq INTEGER PRIMARY KEY, OldId INTEGER UNIQUE)"));
+   qint32 firstId(0);
+   for (QList<qint32>::const_iterator iter = ids.constBegin(); iter != ids.constEnd() && ok; ++iter){
+      qint32 id(*iter);
+      // number the branch in id order, thus copied siblings keep their order; UNION (not UNION ALL) stops at cycles
+      ok = query.exec(QLatin1String("DELETE FROM temp.QXTreeCopy")) &&
+           query.prepare(QString(QLatin1String("INSERT INTO temp.QXTreeCopy (OldId) WITH RECURSIVE Branch(Id) AS "
+                                               "(SELECT ? UNION SELECT %1.%2 FROM %1 JOIN Branch ON %1.%3 = Branch.Id) "
+                                               "SELECT Id FROM Branch ORDER BY Id"))
+                         .arg(table).arg(idField).arg(parentField));
+      if (ok){
+         query.addBindValue(id);
+         ok = query.exec();}
+      int count = ok ? query.numRowsAffected() : 0;
+      // ids above the largest one in the table as of now (including the branches copied before), as other connections
+      // or the source model itself might have added records the index does not know about; read within the
+      // transaction, thus the copy cannot collide
+      firstId = 0;
+      if (ok && count > 0 && query.exec(QString(QLatin1String("SELECT MAX(%1) FROM %2")).arg(idField).arg(table)) && query.next()){
+         qint64 maxId = query.value(0).toLongLong();
+         query.finish();
+         if (maxId < std::numeric_limits<qint32>::max()) firstId = reserveIds(count, qint32(maxId) + 1);}
+      ok = ok && firstId != 0;
+      if (ok){
+         // new id = firstId - 1 + Seq of the old id; the parent of the copied top record is newParent
+         QString newId = QString(QLatin1String("%1 + Map.Seq")).arg(firstId - 1);
+         QString newParentId = QString(QLatin1String("CASE WHEN %1.%2 = %3 THEN %4 ELSE %5 + (SELECT P.Seq FROM temp.QXTreeCopy P WHERE P.OldId = %1.%6) END"))
+                               .arg(table).arg(idField).arg(id).arg(newParent).arg(firstId - 1).arg(parentField);
+         QStringList values;
+         for (int c(0); c < record.count(); ++c){
+            if (c == idCol()) values << newId;
+            else if (c == parentCol()) values << newParentId;
+            else values << table + QLatin1String(".") + fields.at(c);}
+         ok = query.exec(QString(QLatin1String("INSERT INTO %1 (%2) SELECT %3 FROM %1 JOIN temp.QXTreeCopy Map ON %1.%4 = Map.OldId ORDER BY Map.Seq"))
+                         .arg(table).arg(fields.join(QLatin1String(", "))).arg(values.join(QLatin1String(", "))).arg(idField));}}
+   ok = ok && query.exec(QLatin1String("DELETE FROM temp.QXTreeCopy"));
+   // if (!ok) qDebug() << "sqlCopyBranches failed:" << query.lastError().text() << query.lastQuery();
+   query.finish();
+   if (!ok){
+      db.rollback();
+      return false;}
+   if (!db.commit()) return false;
+   lastInsertedId = firstId;      // top record of the last branch, as if copied one by one
+   tableModel->select();      // the database is changed in any case
+   return true;}
+
+/* Removes the branches starting at ids (including all descendants) by a single DELETE within one transaction.
+   The source model is re-populated afterwards. Returns false if nothing was changed. */
+bool QXTreeProxyModel::sqlRemoveBranches(QSqlTableModel* tableModel, const QList<qint32>& ids){
+   QSqlDatabase db = tableModel->database();
+   QSqlDriver* driver = db.driver();
+   QSqlRecord record = db.record(tableModel->tableName());
+   if (!tableModel->submit() || !db.transaction()) return false;      // submit a pending row, if any (OnRowChange)
+   QString table = driver->escapeIdentifier(tableModel->tableName(), QSqlDriver::TableName);
+   QString idField = driver->escapeIdentifier(record.fieldName(idCol()), QSqlDriver::FieldName);
+   QString parentField = driver->escapeIdentifier(record.fieldName(parentCol()), QSqlDriver::FieldName);
+   QStringList idList;
+   foreach (qint32 id, ids) idList << QString::number(id);
+   QSqlQuery query(db);
+   bool ok = query.exec(QString(QLatin1String("DELETE FROM %1 WHERE %2 IN (WITH RECURSIVE Branch(Id) AS "
+                                              "(SELECT %2 FROM %1 WHERE %2 IN (%4) UNION SELECT %1.%2 FROM %1 JOIN Branch ON %1.%3 = Branch.Id) "
+                                              "SELECT Id FROM Branch)"))
+                        .arg(table).arg(idField).arg(parentField).arg(idList.join(QLatin1String(", "))));
+   // if (!ok) qDebug() << "sqlRemoveBranches failed:" << query.lastError().text() << query.lastQuery();
+   query.finish();
+   if (!ok){
+      db.rollback();
+      return false;}
+   if (!db.commit()) return false;
+   tableModel->select();      // the database is changed in any case
+   return true;}
+
+/* Returns the foreign key for displayValue in relation column of the source model, or displayValue itself if column
+   has no relation or displayValue is not found (assume that the value is a foreign key that occurs in not yet committed
+   records). The display values are mapped to keys once per relation model; the map is discarded whenever the relation
+   model changes, see relationModelChanged(). */
+QVariant QXTreeProxyModel::relationKey(QSqlRelationalTableModel* relationalModel, int column, const QVariant& displayValue) const {
+   QSqlRelation relation = relationalModel->relation(column);
+   if (!relation.isValid()) return displayValue;
+   QSqlTableModel* relatedTable = relationalModel->relationModel(column);
+   if (d_relationKeys.value(column).relationModel != relatedTable){
+      // fetching may emit rowsInserted() of the related table, which clears d_relationKeys: hold no reference into it
+      while (relatedTable->canFetchMore(QModelIndex())) relatedTable->fetchMore(QModelIndex());    // lookup table as a whole
+      RelationKeys keys;
+      keys.relationModel = relatedTable;
+      int displayField = relatedTable->fieldIndex(relation.displayColumn());
+      int indexField = relatedTable->fieldIndex(relation.indexColumn());
+      int rows = relatedTable->rowCount(QModelIndex());
+      keys.keyFromDisplay.reserve(rows);
+      for (int r(0); r < rows; ++r){
+         QString display = relatedTable->data(relatedTable->index(r, displayField), Qt::DisplayRole).toString();
+         // display values need not be unique (database content): the first row wins, as with match(..., 1)
+         if (!keys.keyFromDisplay.contains(display)) keys.keyFromDisplay.insert(display, relatedTable->data(relatedTable->index(r, indexField), Qt::DisplayRole));}
+      bool ok(true);
+      ok = ok && connect(relatedTable, SIGNAL(modelReset()), this, SLOT(relationModelChanged()), Qt::UniqueConnection);
+      ok = ok && connect(relatedTable, SIGNAL(layoutChanged()), this, SLOT(relationModelChanged()), Qt::UniqueConnection);
+      ok = ok && connect(relatedTable, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(relationModelChanged()), Qt::UniqueConnection);
+      ok = ok && connect(relatedTable, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(relationModelChanged()), Qt::UniqueConnection);
+      ok = ok && connect(relatedTable, SIGNAL(rowsRemoved(QModelIndex,int,int)), this, SLOT(relationModelChanged()), Qt::UniqueConnection);
+      Q_ASSERT(ok);
+      d_relationKeys.insert(column, keys);}
+   const RelationKeys& keys = d_relationKeys[column];
+   QHash<QString, QVariant>::const_iterator iter = keys.keyFromDisplay.constFind(displayValue.toString());
+   if (iter == keys.keyFromDisplay.constEnd()) return displayValue;
+   return iter.value();}
+
+/* Returns ids together with the ids of all their descendants, collected by a single traversal. Children that are
+   already deleted (but not yet submitted) are skipped together with their branches. */
+QList<qint32> QXTreeProxyModel::branchIds(const QList<qint32>& ids) const {
+   QList<qint32> result(ids);
+   for (int i(0); i < result.count(); ++i){
+      foreach (qint32 childId, childIds(result.at(i))){
          Q_ASSERT(childId != 0);
-         ok = sourceModel()->removeRow(childIndex.row(), QModelIndex());
-         Q_ASSERT(ok); // if the model supported to remove the parent, then it must also be able to remove the child rows
-         removeChildRows(childId);}}}
-
-int QXTreeProxyModel::rowFromId(qint32 recordId, qint32 parentId) const {
-   // qDebug() << "find rowFromId where recordId is" << recordId << "with parentId" << parentId;
-   QModelIndexList childIndices = sourcechildrenFromId(parentId);
-   //d_parentFilterModel->sort(idCol(), Qt::AscendingOrder);
-   int rowNumber(0);
-   bool ok;
-   while (rowNumber < childIndices.count() && sourceModel()->data(childIndices.at(rowNumber)).toInt(&ok) != recordId && ok) ++ rowNumber;
-   Q_ASSERT(ok);
-   if (rowNumber == childIndices.count()) {
-      EXDatabase exception;
-      exception.msg = QLatin1String("row from id not found");
-      exception.id = recordId;}
-   // qDebug() << "found rowFromId" << rowNumber;
-   return rowNumber;}
+         if (!isSourceDeleted(sourceindexFromId(childId))) result.append(childId);}}
+   return result;}
+
+QModelIndex QXTreeProxyModel::proxyIndexFromId(qint32 id, int column) const {
+   if (id == 0) return QModelIndex();
+   const QHash<qint32, int>& positions = d_index.positionFromId.shardFor(id);
+   QHash<qint32, int>::const_iterator iter = positions.constFind(id);
+   if (iter == positions.constEnd()) throw EXDatabase(QLatin1String("record has no valid parent field"), id);
+   return createIndex(iter.value(), column, id);}
 
 QModelIndex QXTreeProxyModel::sourceindexFromId(qint32 id) const {
    // qDebug() << "sourceindexFromId" << id;
-   QModelIndexList idxList = sourceModel()->match(sourceModel()->index(0, idCol()), Qt::DisplayRole, id, -1, Qt::MatchExactly);
-   Q_ASSERT_X(!idxList.isEmpty(), "key not found", QString::number(id).toLocal8Bit());
-   Q_ASSERT_X(idxList.at(0).isValid(), "index for key is not valid", QString::number(id).toLocal8Bit());
-   if (idxList.count() > 1){
+   const QHash<qint32, int>& rows = d_index.rowFromId.shardFor(id);
+   QHash<qint32, int>::const_iterator iter = rows.constFind(id);
+   Q_ASSERT_X(iter != rows.constEnd(), "key not found", QString::number(id).toLocal8Bit());
+   if (iter == rows.constEnd()) return QModelIndex();
+   if (d_index.duplicateIds.contains(id)){
       EXDatabase exception;
       exception.id = id;
       exception.msg = QLatin1String("duplicate key found");
       throw exception;}
-   return idxList.at(0);}
+   QModelIndex idx = sourceModel()->index(iter.value(), idCol());
+   Q_ASSERT_X(idx.isValid(), "index for key is not valid", QString::number(id).toLocal8Bit());
+   return idx;}
 
-QModelIndexList QXTreeProxyModel::sourcechildrenFromId(qint32 id) const {
-   // qDebug() << "sourcechildrenFromId looks for" << id << "in column" << parentCol();
-   QModelIndexList parentidxList = sourceModel()->match(sourceModel()->index(0, parentCol()), Qt::DisplayRole, id, -1, Qt::MatchExactly);
-   // qDebug() << "   sourcechildrenFromId for" << id << "found" << parentidxList.count() << "child indices in parent column";
-   QModelIndexList idxList;
-   foreach (QModelIndex idx, parentidxList) idxList.append(idx.sibling(idx.row(), idCol()));
-   // qDebug() << "   sourcechildrenFromId for" << id << "found" << idxList.count() << "child indices in id column";
-   return idxList;}
+const QVector<qint32>& QXTreeProxyModel::childIds(qint32 parentId) const {
+   static const QVector<qint32> noChildren;
+   const QHash<qint32, QVector<qint32> >& children = d_index.childrenFromId.shardFor(parentId);
+   QHash<qint32, QVector<qint32> >::const_iterator iter = children.constFind(parentId);
+   return (iter == children.constEnd()) ? noChildren : iter.value();}
 
+// cached state of sourceRowDeleted(), kept current by sourceHeaderDataChanged and the row signals
 bool QXTreeProxyModel::isSourceDeleted(QModelIndex sourceIndex) const {
-   QString rowHeader = sourceModel()->headerData(sourceIndex.row(), Qt::Vertical, Qt::DisplayRole).toString();
+   int r = sourceIndex.row();
+   return r >= 0 && r < d_index.deletedRows.size() && d_index.deletedRows.testBit(r);}
+
+// QSqlTableModel marks rows removed with OnManualSubmit by the vertical header "!"
+bool QXTreeProxyModel::sourceRowDeleted(int sourceRow) const {
+   QString rowHeader = sourceModel()->headerData(sourceRow, Qt::Vertical, Qt::DisplayRole).toString();
    return (rowHeader == QLatin1String("!"));}
 
-qint32 QXTreeProxyModel::nextFreeId() const {
-   static qint32 lastId(45);
-   // qDebug() << "nextFreeId after" << lastId;
-   bool idExisting(true);
-   while (idExisting && ++lastId < std::numeric_limits<qint32>::max()){
-      QModelIndexList idxList = sourceModel()->match(sourceModel()->index(0, idCol(), QModelIndex()), Qt::DisplayRole, lastId, 1, Qt::MatchExactly);
-      idExisting = !idxList.isEmpty();}
-   // qDebug() << "   is" << lastId;
-   if (idExisting) return 0;
-   else return lastId;}
+// inserts count (> 0) or removes -count (< 0) source rows at sourceRow into the deletion bitset
+void QXTreeProxyModel::shiftDeletedRows(int sourceRow, int count){
+   QBitArray& deleted = d_index.deletedRows;
+   int oldSize = deleted.size();
+   if (count > 0){
+      deleted.resize(oldSize + count);
+      for (int r(oldSize - 1); r >= sourceRow; --r) deleted.setBit(r + count, deleted.testBit(r));
+      for (int r(sourceRow); r < sourceRow + count; ++r){
+         deleted.setBit(r, sourceRowDeleted(r));
+         if (deleted.testBit(r)) ++d_index.deletedCount;}}
+   else if (count < 0){
+      for (int r(sourceRow); r < sourceRow - count && r < oldSize; ++r) if (deleted.testBit(r)) --d_index.deletedCount;
+      for (int r(sourceRow - count); r < oldSize; ++r) deleted.setBit(r + count, deleted.testBit(r));
+      deleted.resize(qMax(oldSize + count, sourceRow));}}
+
+/* The index mirrors the id column of the source model: it is built in a single pass whenever the source model, idCol
+   or the entire content of the source model changes, and it is kept current by the source* slots afterwards. */
+void QXTreeProxyModel::buildIndex(){
+   cancelBuild();
+   ++d_buildCount;
+   d_index = TreeIndex();
+   clearExpectedChildCounts();
+   d_integrityReport = IntegrityReport();
+   d_roleChangedIds.clear();
+   d_unlinkedDepth.clear();
+   if (!sourceModel() || idCol() < 0) return;
+   SourceColumns columns;
+   readColumns(columns);
+   buildTree(d_index, columns, 0, 0);
+   checkIntegrity(d_index, parentCol() >= 0, d_integrityReport);}
+
+// full build of the index, synchronous or on a worker thread (see asyncBuild); call between beginResetModel() and endResetModel()
+void QXTreeProxyModel::resetIndex(){
+   if (d_asyncBuild) startBuild();
+   else buildIndex();}
+
+// reads the id and parent column of all source rows, each field once
+void QXTreeProxyModel::readColumns(SourceColumns& columns) const {
+   int rows = sourceModel()->rowCount(QModelIndex());
+   columns.ids.resize(rows);
+   columns.parentIds.fill(0, rows);
+   columns.parentValid.fill(false, rows);
+   columns.deletedRows.fill(false, rows);
+   for (int r(0); r < rows; ++r){
+      columns.ids[r] = sourceId(r);
+      if (parentCol() >= 0){
+         bool ok;
+         columns.parentIds[r] = sourceParentId(r, &ok);
+         columns.parentValid.setBit(r, ok);}
+      if (sourceRowDeleted(r)) columns.deletedRows.setBit(r);}}
+
+/* Builds index from copies of the source columns, as indexRow() for each row would. Does not access the model, thus
+   it may run on any thread; it stops early if cancelled is set and reports its progress to progressReceiver (both
+   optional). */
+void QXTreeProxyModel::buildTree(TreeIndex& index, const SourceColumns& columns, const QAtomicInt* cancelled, QXTreeProxyModel* progressReceiver){
+   const int progressStep(1 << 16);
+   int rows = columns.ids.count();
+   index = TreeIndex();
+   index.idFromRow = columns.ids;
+   index.deletedRows = columns.deletedRows;
+   index.deletedCount = columns.deletedRows.count(true);
+   index.rowFromId.reserve(rows);
+   index.parentFromId.reserve(rows);
+   index.positionFromId.reserve(rows);
+   int threads = QThread::idealThreadCount();
+   bool parallel = (rows >= ParallelBuildRows && threads > 1);
+   if (parallel) buildTreeParallel(index, columns, threads, cancelled, progressReceiver);
+   else for (int r(0); r < rows; ++r){
+      if (r % progressStep == 0 && r > 0){
+         if (cancelled && int(*cancelled) != 0) return;
+         if (progressReceiver) QMetaObject::invokeMethod(progressReceiver, "buildProgress", Qt::QueuedConnection, Q_ARG(int, r), Q_ARG(int, rows));}
+      qint32 id = columns.ids.at(r);
+      if (id == 0) continue;
+      if (index.rowFromId.contains(id)){
+         index.duplicateIds.insert(id);
+         continue;}
+      index.rowFromId.insert(id, r);
+      if (id > index.maxId) index.maxId = id;
+      if (!columns.parentValid.testBit(r)) continue;
+      qint32 parentId = columns.parentIds.at(r);
+      index.parentFromId.insert(id, parentId);
+      QVector<qint32>& siblings = index.childrenFromId[parentId];
+      index.positionFromId.insert(id, siblings.count());
+      siblings.append(id);}
+   if (cancelled && int(*cancelled) != 0) return;
+   if (!parallel) measureBranch(index, 0, -1, 0);     // size and depth of all records attached to the root
+   if (progressReceiver) QMetaObject::invokeMethod(progressReceiver, "buildProgress", Qt::QueuedConnection, Q_ARG(int, rows), Q_ARG(int, rows));}
+
+/* State shared by the parts of buildTreeParallel(). Range phases split the source rows into contiguous ranges, one
+   per part; shard phases give each part every parts-th shard of the IdHash tables, thus each shard has one writer. */
+struct QXTreeProxyModel::ParallelBuild{
+   struct Entry{
+      qint32 key;       // id that decides the shard: the record's own id, or its parent id when linking children
+      qint32 id;
+      int row;};
+   struct Visit{      // record on the path of measureRows()
+      qint32 id;
+      int row;
+      int visitedChildren;
+      int size;};
+   const SourceColumns* columns;
+   const TreeIndex* index;        // read only, thus the tables do not detach while parts read them
+   int parts;
+   QVector<int> rangeStart;                        // first row of each range, rangeStart[parts] is the row count
+   QVector<QVector<QVector<Entry> > > buckets;     // entries of each range, by shard, in row order
+   QVector<char> first;           // row holds the first occurrence of its id; no QBitArray, parts write concurrently
+   QVector<QSet<qint32> > duplicateIds;            // by shard
+   QVector<qint32> maxIds;                         // by shard
+   QVector<int> positions, depths, sizes;          // by source row, -1 if not set
+   QHash<qint32, int>* rowShards;                  // shards of the tables of index, fetched before the parts run
+   QHash<qint32, qint32>* parentShards;
+   QHash<qint32, QVector<qint32> >* childrenShards;
+   QHash<qint32, int>* positionShards;
+   QHash<qint32, int>* depthShards;
+   QHash<qint32, int>* sizeShards;};
+
+/* Same result as the loop in buildTree(), for large tables on several threads. Each phase runs one part per thread.
+   The rows are bucketed by the shard of their id per row range, and each shard is then filled from the buckets of all
+   ranges in range order, thus first occurrences, duplicates and sibling order are those of the serial loop and do not
+   depend on the number of threads. Sizes and depths are measured per first-level branch, thus that phase only runs in
+   parallel if the root has several children. */
+void QXTreeProxyModel::buildTreeParallel(TreeIndex& index, const SourceColumns& columns, int threads, const QAtomicInt* cancelled, QXTreeProxyModel* progressReceiver){
+   static const BuildPhase phases[] = {BucketIds, IndexIds, BucketChildren, LinkChildren, MeasureBranches, IndexRecords};
+   const int phaseCount(sizeof(phases) / sizeof(phases[0]));
+   int rows = columns.ids.count();
+   ParallelBuild build;
+   build.columns = &columns;
+   build.index = &index;
+   build.parts = threads;
+   for (int part(0); part <= threads; ++part) build.rangeStart << int(qint64(rows) * part / threads);
+   build.buckets.fill(QVector<QVector<ParallelBuild::Entry> >(IdHashShards), threads);
+   build.first.fill(0, rows);
+   build.duplicateIds.resize(IdHashShards);
+   build.maxIds.fill(0, IdHashShards);
+   build.positions.fill(-1, rows);
+   build.depths.fill(-1, rows);
+   build.sizes.fill(0, rows);
+   build.rowShards = index.rowFromId.shards();
+   build.parentShards = index.parentFromId.shards();
+   build.childrenShards = index.childrenFromId.shards();
+   build.positionShards = index.positionFromId.shards();
+   build.depthShards = index.depthFromId.shards();
+   build.sizeShards = index.sizeFromId.shards();
+   for (int phase(0); phase < phaseCount; ++phase){
+      if (cancelled && int(*cancelled) != 0) return;
+      runBuildPhase(build, phases[phase], threads);
+      if (progressReceiver) QMetaObject::invokeMethod(progressReceiver, "buildProgress", Qt::QueuedConnection, Q_ARG(int, int(qint64(rows) * (phase + 1) / (phaseCount + 1))), Q_ARG(int, rows));}
+   int size(0);
+   foreach (qint32 branchId, index.childrenFromId.value(0)) size += index.sizeFromId.value(branchId);
+   index.sizeFromId.insert(0, size);
+   for (int s(0); s < IdHashShards; ++s){
+      index.duplicateIds.unite(build.duplicateIds.at(s));
+      if (build.maxIds.at(s) > index.maxId) index.maxId = build.maxIds.at(s);}}
+
+// runs one part of phase on each of parts threads and waits for all of them
+void QXTreeProxyModel::runBuildPhase(ParallelBuild& build, BuildPhase phase, int parts){
+   QList<QFuture<void> > futures;
+   for (int part(0); part < parts; ++part) futures << QtConcurrent::run(&QXTreeProxyModel::buildPart, &build, int(phase), part);
+   foreach (QFuture<void> future, futures) future.waitForFinished();}
+
+// one part of a phase of buildTreeParallel(): the row range part, or the shards part, part + parts, ...
+void QXTreeProxyModel::buildPart(ParallelBuild* build, int phase, int part){
+   const SourceColumns& columns = *build->columns;
+   QVector<QVector<ParallelBuild::Entry> >& buckets = build->buckets[part];
+   switch (phase){
+   case BucketIds:
+      for (int r(build->rangeStart.at(part)); r < build->rangeStart.at(part + 1); ++r){
+         qint32 id = columns.ids.at(r);
+         if (id == 0) continue;
+         ParallelBuild::Entry entry = {id, id, r};
+         buckets[idShard(id)].append(entry);}
+      break;
+   case IndexIds:
+      for (int s(part); s < IdHashShards; s += build->parts){
+         QHash<qint32, int>& rowFromId = build->rowShards[s];
+         for (int range(0); range < build->parts; ++range) foreach (const ParallelBuild::Entry& entry, build->buckets.at(range).at(s)){
+            if (rowFromId.contains(entry.id)){
+               build->duplicateIds[s].insert(entry.id);
+               continue;}
+            rowFromId.insert(entry.id, entry.row);
+            build->first[entry.row] = 1;
+            if (entry.id > build->maxIds.at(s)) build->maxIds[s] = entry.id;
+            if (columns.parentValid.testBit(entry.row)) build->parentShards[s].insert(entry.id, columns.parentIds.at(entry.row));}}
+      break;
+   case BucketChildren:
+      for (int s(0); s < IdHashShards; ++s) buckets[s].clear();
+      for (int r(build->rangeStart.at(part)); r < build->rangeStart.at(part + 1); ++r){
+         if (!build->first.at(r) || !columns.parentValid.testBit(r)) continue;
+         qint32 parentId = columns.parentIds.at(r);
+         ParallelBuild::Entry entry = {parentId, columns.ids.at(r), r};
+         buckets[idShard(parentId)].append(entry);}
+      break;
+   case LinkChildren:
+      for (int s(part); s < IdHashShards; s += build->parts){
+         QHash<qint32, QVector<qint32> >& childrenFromId = build->childrenShards[s];
+         for (int range(0); range < build->parts; ++range) foreach (const ParallelBuild::Entry& entry, build->buckets.at(range).at(s)){
+            QVector<qint32>& siblings = childrenFromId[entry.key];
+            build->positions[entry.row] = siblings.count();
+            siblings.append(entry.id);}}
+      break;
+   case MeasureBranches:{
+      const QVector<qint32> branchIds = build->index->childrenFromId.value(0);
+      for (int i(part); i < branchIds.count(); i += build->parts) measureRows(*build->index, branchIds.at(i), build->depths.data(), build->sizes.data());
+      break;}
+   case IndexRecords:
+      for (int s(part); s < IdHashShards; s += build->parts){
+         const QHash<qint32, int>& rowFromId = build->index->rowFromId.shard(s);
+         for (QHash<qint32, int>::const_iterator iter = rowFromId.constBegin(); iter != rowFromId.constEnd(); ++iter){
+            int row = iter.value();
+            if (build->positions.at(row) >= 0) build->positionShards[s].insert(iter.key(), build->positions.at(row));
+            if (build->depths.at(row) < 0) continue;
+            build->depthShards[s].insert(iter.key(), build->depths.at(row));
+            build->sizeShards[s].insert(iter.key(), build->sizes.at(row));}}
+      break;
+   default:
+      Q_ASSERT_X(false, "QXTreeProxyModel::buildPart", "unknown phase");}}
+
+/* As measureBranch() for a first-level branch, but only reads index and stores depth and size by the source row of
+   each record, thus several branches can be measured concurrently. */
+void QXTreeProxyModel::measureRows(const TreeIndex& index, qint32 branchId, int* depths, int* sizes){
+   typedef ParallelBuild::Visit Visit;
+   const QVector<qint32> noChildren;
+   QVector<Visit> stack;
+   Visit branch = {branchId, index.rowFromId.value(branchId), 0, 1};
+   stack.append(branch);
+   while (!stack.isEmpty()){
+      Visit& visit = stack.last();
+      const QHash<qint32, QVector<qint32> >& shard = index.childrenFromId.shardFor(visit.id);
+      QHash<qint32, QVector<qint32> >::const_iterator iter = shard.constFind(visit.id);
+      const QVector<qint32>& children = (iter == shard.constEnd()) ? noChildren : iter.value();
+      if (visit.visitedChildren < children.count()){
+         Visit child = {children.at(visit.visitedChildren++), 0, 0, 1};
+         child.row = index.rowFromId.value(child.id);
+         stack.append(child);}
+      else {      // all children measured
+         depths[visit.row] = stack.count() - 1;
+         sizes[visit.row] = visit.size;
+         int size = visit.size;
+         stack.remove(stack.count() - 1);
+         if (!stack.isEmpty()) stack.last().size += size;}}}
+
+/* Collects the violations of the requirements on the source model (see class description) from the index just built,
+   without reading the source model again. Linear in the number of records: each record that is not reachable from the
+   root is visited once while following its parents. */
+void QXTreeProxyModel::checkIntegrity(const TreeIndex& index, bool hasParents, IntegrityReport& report){
+   report = IntegrityReport();
+   for (int r(0); r < index.idFromRow.count(); ++r){
+      qint32 id = index.idFromRow.at(r);
+      if (id == 0 || (hasParents && index.rowFromId.value(id) == r && !index.parentFromId.contains(id))) report.invalidRows << r;}
+   report.duplicateIds = index.duplicateIds.toList();
+   qSort(report.duplicateIds);
+   if (!hasParents) return;
+   report.unreachableRecords = index.parentFromId.count() - index.depthFromId.count();
+   QHash<qint32, bool> done;      // unreachable records visited: true if done, false if on the current path
+   for (int s(0); s < IdHashShards; ++s) for (QHash<qint32, qint32>::const_iterator iter = index.parentFromId.shard(s).constBegin(); iter != index.parentFromId.shard(s).constEnd(); ++iter){
+      qint32 id = iter.key();
+      if (iter.value() != 0 && !index.rowFromId.contains(iter.value())) report.orphanIds << id;
+      QList<qint32> path;
+      while (id != 0 && !index.depthFromId.contains(id) && index.parentFromId.contains(id) && !done.value(id, false)){
+         if (done.contains(id)){     // reached the path again: a cycle
+            for (int i(path.indexOf(id)); i < path.count(); ++i) report.cycleIds << path.at(i);
+            break;}
+         done.insert(id, false);
+         path << id;
+         id = index.parentFromId.value(id);}
+      foreach (qint32 pathId, path) done.insert(pathId, true);}
+   qSort(report.orphanIds);
+   qSort(report.cycleIds);
+   // if (!report.isValid()) qDebug() << "integrity:" << report.invalidRows << report.duplicateIds << report.orphanIds << report.cycleIds;
+   }
+
+// worker thread for asyncBuild: builds the index from copies of the source columns
+class QXTreeProxyModel::IndexBuilder : public QThread{
+public:
+   IndexBuilder(QXTreeProxyModel* model): QThread(model), hasParents(false), d_model(model) {}
+   SourceColumns columns;
+   bool hasParents;
+   TreeIndex index;
+   IntegrityReport report;
+   QAtomicInt cancelled;
+protected:
+   void run(){
+      buildTree(index, columns, &cancelled, d_model);
+      if (int(cancelled) == 0) checkIntegrity(index, hasParents, report);}
+private:
+   QXTreeProxyModel* d_model;};
+
+/* Starts a full build of the index on a worker thread; the model is empty until indexBuilt() swaps in the result. The
+   source columns are read here, as models must only be accessed from the thread they live in. */
+void QXTreeProxyModel::startBuild(){
+   cancelBuild();
+   ++d_buildCount;
+   d_index = TreeIndex();
+   clearExpectedChildCounts();
+   d_integrityReport = IntegrityReport();
+   d_roleChangedIds.clear();
+   d_unlinkedDepth.clear();
+   d_buildRestart = false;
+   if (!sourceModel() || idCol() < 0) return;
+   d_builder = new IndexBuilder(this);
+   d_builder->hasParents = (parentCol() >= 0);
+   readColumns(d_builder->columns);
+   bool ok = connect(d_builder, SIGNAL(finished()), this, SLOT(indexBuilt()));
+   Q_ASSERT(ok);
+   Q_UNUSED(ok);
+   d_builder->start();}
+
+void QXTreeProxyModel::cancelBuild(){
+   if (!d_builder) return;
+   disconnect(d_builder, 0, this, 0);
+   d_builder->cancelled.fetchAndStoreOrdered(1);
+   d_builder->wait();
+   delete d_builder;
+   d_builder = 0;}
+
+qint32 QXTreeProxyModel::sourceId(int sourceRow) const {
+   bool ok;
+   qint32 id = sourceModel()->data(sourceModel()->index(sourceRow, idCol()), Qt::DisplayRole).toInt(&ok);
+   return ok ? id : 0;}     // empty id field: record not yet fully constructed
+
+qint32 QXTreeProxyModel::sourceParentId(int sourceRow, bool* ok) const {
+   QVariant parentIdVariant = sourceModel()->data(sourceModel()->index(sourceRow, parentCol()), Qt::DisplayRole);
+   *ok = true;
+   if (parentIdVariant.isNull() || parentIdVariant.toString().isEmpty()) return 0;    // empty is equivalent to zero
+   return parentIdVariant.toInt(ok);}
+
+void QXTreeProxyModel::indexRow(int sourceRow){
+   qint32 id = sourceId(sourceRow);
+   d_index.idFromRow[sourceRow] = id;
+   if (id == 0) return;
+   if (d_index.rowFromId.contains(id)) d_index.duplicateIds.insert(id);
+   else {
+      d_index.rowFromId.insert(id, sourceRow);
+      if (id > d_index.maxId) d_index.maxId = id;
+      linkNode(id, sourceRow);}}
+
+void QXTreeProxyModel::unindexRow(int sourceRow){
+   qint32 id = d_index.idFromRow.at(sourceRow);
+   if (id == 0) return;
+   d_index.idFromRow[sourceRow] = 0;
+   if (!d_index.duplicateIds.contains(id)) {
+      unlinkNode(id);
+      d_index.rowFromId.remove(id);}
+   else if (d_index.rowFromId.value(id) == sourceRow){      // rare case, thus a linear search is acceptable
+      if (d_index.idFromRow.count(id) < 2) d_index.duplicateIds.remove(id);
+      unlinkNode(id, true);
+      int remainingRow = d_index.idFromRow.indexOf(id);
+      d_index.rowFromId.insert(id, remainingRow);
+      linkNode(id, remainingRow);}
+   else if (d_index.idFromRow.count(id) < 2) d_index.duplicateIds.remove(id);}
+
+/* Appends id to the child list of its parent. The proxy keeps its own sibling order: it is the source row order when
+   the index is built and new records are always appended, no matter where the source model stores them. Records
+   with an illegal entry in the parent field are not part of the tree. A branch kept by unlinkNode(id, true) keeps
+   the sizes of its records, and their depths unless it is attached at another depth; thus moving a branch costs
+   O(depth), not O(size of the branch). */
+void QXTreeProxyModel::linkNode(qint32 id, int sourceRow){
+   bool kept = d_unlinkedDepth.contains(id);
+   int oldDepth = d_unlinkedDepth.take(id);
+   bool ok(parentCol() >= 0);
+   qint32 parentId = ok ? sourceParentId(sourceRow, &ok) : 0;
+   if (!ok){
+      if (kept) forgetBranch(id);
+      return;}
+   d_index.parentFromId.insert(id, parentId);
+   QVector<qint32>& siblings = d_index.childrenFromId[parentId];
+   d_index.positionFromId.insert(id, siblings.count());
+   siblings.append(id);
+   // the records of a kept branch still have their depth: a parent within it is a cycle, not part of the tree
+   bool attached = (parentId == 0 || d_index.depthFromId.contains(parentId)) && !(kept && isInBranch(parentId, id));
+   if (!attached){      // parent is not (yet) part of the tree
+      if (kept) forgetBranch(id);
+      return;}
+   // the branch of id is attached: add its size to the ancestors
+   int depth = (parentId == 0) ? 0 : d_index.depthFromId.value(parentId) + 1;
+   int size;
+   if (kept){
+      size = d_index.sizeFromId.value(id);
+      if (depth != oldDepth) shiftBranchDepth(id, depth - oldDepth);}
+   else {
+      QList<qint32> branchIds;
+      size = measureBranch(d_index, id, depth, &branchIds);
+      d_roleChangedIds << branchIds;}
+   for (qint32 ancestorId(parentId); ; ancestorId = d_index.parentFromId.value(ancestorId)){
+      d_index.sizeFromId[ancestorId] += size;
+      if (ancestorId == 0) break;
+      d_roleChangedIds << ancestorId;}}
+
+/* Removes id from the child list of its parent and subtracts the size of its branch from the ancestors. The sizes and
+   depths within the branch are forgotten, unless keepBranch is set as linkNode() is called for id right away. */
+void QXTreeProxyModel::unlinkNode(qint32 id, bool keepBranch){
+   QHash<qint32, qint32>& parents = d_index.parentFromId.shardFor(id);
+   QHash<qint32, qint32>::iterator parentIter = parents.find(id);
+   if (parentIter == parents.end()) return;
+   const QHash<qint32, int>& depths = d_index.depthFromId.shardFor(id);
+   QHash<qint32, int>::const_iterator depthIter = depths.constFind(id);
+   if (depthIter != depths.constEnd()){      // the branch of id leaves the tree: subtract its size from the ancestors
+      int size = d_index.sizeFromId.value(id);
+      for (qint32 ancestorId(parentIter.value()); ; ancestorId = d_index.parentFromId.value(ancestorId)){
+         d_index.sizeFromId[ancestorId] -= size;
+         if (ancestorId == 0) break;
+         d_roleChangedIds << ancestorId;}
+      if (keepBranch) d_unlinkedDepth.insert(id, depthIter.value());
+      else forgetBranch(id);}
+   QHash<qint32, QVector<qint32> >& children = d_index.childrenFromId.shardFor(parentIter.value());
+   QHash<qint32, QVector<qint32> >::iterator childrenIter = children.find(parentIter.value());
+   Q_ASSERT(childrenIter != children.end());
+   int position = d_index.positionFromId.take(id);
+   Q_ASSERT(childrenIter->at(position) == id);
+   childrenIter->remove(position);
+   for (int pos(position); pos < childrenIter->count(); ++pos) d_index.positionFromId[childrenIter->at(pos)] = pos;
+   if (childrenIter->isEmpty()) children.erase(childrenIter);
+   parents.erase(parentIter);}
+
+/* Updates the index for a source row after its id field or its parent field changed. Depending on whether the record
+   is visible before and after the change, this is announced as row move, row removal or row insertion. */
+void QXTreeProxyModel::reindexRow(int sourceRow){
+   qint32 oldId = d_index.idFromRow.at(sourceRow);
+   qint32 newId = sourceId(sourceRow);
+   bool parentOk(parentCol() >= 0);
+   qint32 newParentId = parentOk ? sourceParentId(sourceRow, &parentOk) : 0;
+   bool linked = (oldId != 0 && d_index.rowFromId.value(oldId) == sourceRow && d_index.parentFromId.contains(oldId));
+   qint32 oldParentId = linked ? d_index.parentFromId.value(oldId) : 0;
+   bool oldVisible = linked && isAttached(oldParentId);
+   if (oldId != newId || !linked){     // different record, e.g. id assigned to a freshly inserted row
+      if (oldVisible){
+         int position = d_index.positionFromId.value(oldId);
+         emit beginRemoveRows(proxyIndexFromId(oldParentId), position, position);}
+      unindexRow(sourceRow);
+      if (oldVisible) emit endRemoveRows();
+      bool newVisible = (newId != 0 && parentOk && !d_index.rowFromId.contains(newId) && isAttached(newParentId));
+      int position = childIds(newParentId).count();
+      if (newVisible) emit beginInsertRows(proxyIndexFromId(newParentId), position, position);
+      indexRow(sourceRow);
+      if (newVisible) emit endInsertRows();
+      return;}
+   if (parentOk && newParentId == oldParentId) return;     // neither id nor parent changed
+   // a record must not become its own ancestor: it is detached from the tree then
+   bool newVisible = parentOk && isAttached(newParentId) && !isInBranch(newParentId, oldId);
+   int oldPosition = d_index.positionFromId.value(oldId);
+   int newPosition = childIds(newParentId).count();
+   bool moved = (oldVisible && newVisible);
+   if (moved && !beginMoveRows(proxyIndexFromId(oldParentId), oldPosition, oldPosition, proxyIndexFromId(newParentId), newPosition)){
+      Q_ASSERT_X(false, "reindexRow", "invalid row move");
+      beginResetModel();
+      unlinkNode(oldId, true);
+      linkNode(oldId, sourceRow);
+      endResetModel();
+      return;}
+   if (oldVisible && !newVisible) emit beginRemoveRows(proxyIndexFromId(oldParentId), oldPosition, oldPosition);
+   if (!oldVisible && newVisible) emit beginInsertRows(proxyIndexFromId(newParentId), newPosition, newPosition);
+   unlinkNode(oldId, parentOk);
+   if (parentOk) linkNode(oldId, sourceRow);
+   if (moved) emit endMoveRows();
+   else if (oldVisible) emit endRemoveRows();
+   else if (newVisible) emit endInsertRows();}
+
+/* Returns true if id is connected to the invisible root item, i.e., if the record is visible in the proxy model.
+   Records with a missing parent and circularly connected records are not; attached records are those with a depth. */
+bool QXTreeProxyModel::isAttached(qint32 id) const {
+   return id == 0 || d_index.depthFromId.contains(id);}
+
+// returns true if branchId is id itself or one of its ancestors
+bool QXTreeProxyModel::isInBranch(qint32 id, qint32 branchId) const {
+   int steps(0);
+   int maxSteps = d_index.parentFromId.count();
+   while (id != branchId && id != 0){
+      const QHash<qint32, qint32>& parents = d_index.parentFromId.shardFor(id);
+      QHash<qint32, qint32>::const_iterator iter = parents.constFind(id);
+      if (iter == parents.constEnd() || ++steps > maxSteps) return false;
+      id = iter.value();}
+   return id == branchId;}
+
+/* Sets the depth and the size of all records in the branch of branchId, branchId having depth branchDepth, by a
+   single depth-first traversal (-1 for the root, whose size is the number of all attached records). Appends the ids of
+   the branch to measuredIds (if given). Returns the size of the branch. */
+int QXTreeProxyModel::measureBranch(TreeIndex& index, qint32 branchId, int branchDepth, QList<qint32>* measuredIds){
+   static const QVector<qint32> noChildren;
+   QVector<QPair<qint32, int> > stack;     // id and number of its children visited so far, for each record on the path
+   stack.append(qMakePair(branchId, 0));
+   if (branchId != 0) index.depthFromId.insert(branchId, branchDepth);
+   while (!stack.isEmpty()){
+      qint32 id = stack.last().first;
+      const QHash<qint32, QVector<qint32> >& shard = index.childrenFromId.shardFor(id);
+      QHash<qint32, QVector<qint32> >::const_iterator iter = shard.constFind(id);
+      const QVector<qint32>& children = (iter == shard.constEnd()) ? noChildren : iter.value();
+      if (stack.last().second < children.count()){
+         qint32 childId = children.at(stack.last().second++);
+         index.depthFromId.insert(childId, branchDepth + stack.count());
+         stack.append(qMakePair(childId, 0));}
+      else {      // all children measured
+         int size(id == 0 ? 0 : 1);
+         foreach (qint32 childId, children) size += index.sizeFromId.value(childId);
+         index.sizeFromId.insert(id, size);
+         if (measuredIds && id != 0) measuredIds->append(id);
+         stack.remove(stack.count() - 1);}}
+   return index.sizeFromId.value(branchId);}
+
+// removes depth and size of all records in the branch of branchId, as it is detached from the tree
+void QXTreeProxyModel::forgetBranch(qint32 branchId){
+   QList<qint32> ids;
+   ids << branchId;
+   for (int i(0); i < ids.count(); ++i){
+      d_index.depthFromId.remove(ids.at(i));
+      d_index.sizeFromId.remove(ids.at(i));
+      foreach (qint32 childId, childIds(ids.at(i))) ids << childId;}}
+
+// adds delta to the depth of all records in the branch of branchId, as it is attached at another depth
+void QXTreeProxyModel::shiftBranchDepth(qint32 branchId, int delta){
+   QList<qint32> ids;
+   ids << branchId;
+   for (int i(0); i < ids.count(); ++i){
+      d_index.depthFromId[ids.at(i)] += delta;
+      d_roleChangedIds << ids.at(i);
+      foreach (qint32 childId, childIds(ids.at(i))) ids << childId;}}
+
+/* Emits dataChanged() for the records whose subtree size or depth changed by linkNode() and unlinkNode() since the
+   last call; called when the change of the structure is complete, as dataChanged() must not be emitted between
+   beginInsertRows() and endInsertRows() etc. */
+void QXTreeProxyModel::emitRoleChanges(){
+   d_unlinkedDepth.clear();
+   if (d_roleChangedIds.isEmpty()) return;
+   QList<int> rows;
+   foreach (qint32 id, d_roleChangedIds) if (d_index.depthFromId.contains(id)) rows << d_index.rowFromId.value(id);
+   d_roleChangedIds.clear();
+   qSort(rows);
+   int first(0);
+   while (first < rows.count()){
+      int last(first);
+      while (last + 1 < rows.count() && rows.at(last + 1) <= rows.at(last) + 1) ++last;
+      forwardDataChanged(rows.at(first), rows.at(last), 0, columnCount() - 1);
+      first = last + 1;}}
+
+// returns id and all its ancestors (without the root), following the parent fields: O(depth)
+QSet<qint32> QXTreeProxyModel::ancestorIds(qint32 id) const {
+   QSet<qint32> result;
+   while (id != 0 && !result.contains(id)){      // stop at a cycle
+      result.insert(id);
+      id = d_index.parentFromId.value(id);}
+   return result;}
+
+void QXTreeProxyModel::renumberRows(int firstSourceRow){
+   for (int r(firstSourceRow); r < d_index.idFromRow.count(); ++r){
+      qint32 id = d_index.idFromRow.at(r);
+      if (id != 0) d_index.rowFromId[id] = r;}
+   foreach (qint32 id, d_index.duplicateIds) d_index.rowFromId.insert(id, d_index.idFromRow.indexOf(id));}
+
+/* Reserves count consecutive ids that are not used in the source model and returns the first one (or 0 if the id
+   range is exhausted). Ids are allocated above the largest id in the index and above all ids handed out before by this
+   model, thus none is handed out twice even if its record is not yet in the source model. Ids of removed records are
+   not re-used, as they might still be referenced (e.g., by uncommitted deletions or by other tables). The first id is
+   at least minId, e.g. one above the largest id in the database. */
+qint32 QXTreeProxyModel::reserveIds(int count, qint32 minId){
+   Q_ASSERT(count > 0);
+   qint32 firstId = qMax(qMax(d_nextFreeId, d_index.maxId + 1), minId);
+   if (firstId <= 0 || firstId > std::numeric_limits<qint32>::max() - count) return 0;
+   d_nextFreeId = firstId + count;
+   // qDebug() << "reserveIds" << count << "starting with" << firstId;
+   return firstId;}
 
 //private slots, needed to forward signals
 
 void QXTreeProxyModel::sourceDataChanged(const QModelIndex &source_top_left, const QModelIndex &source_bottom_right){
    // qDebug() << "sourceDataChanged"  << source_top_left << source_top_left.model()->data(source_top_left, Qt::DisplayRole);
    Q_ASSERT(sourceModel());
+   if (d_builder){      // index is being built from the previous content, see asyncBuild
+      d_buildRestart = true;
+      return;}
    Q_ASSERT(source_top_left.isValid());
    Q_ASSERT(source_bottom_right.isValid());
-   if (source_top_left.column() <= boost::numeric_cast<int>(idCol()) && source_bottom_right.column() >= boost::numeric_cast<int>(idCol())){
-      emit beginResetModel();
-      emit endResetModel();}
-   else if (source_top_left.column() <= boost::numeric_cast<int>(parentCol()) && source_bottom_right.column() >= boost::numeric_cast<int>(parentCol())){
-      emit beginResetModel();
-      emit endResetModel();}
-   else for (int r(source_top_left.row()); r <= source_bottom_right.row(); ++r)
-   for (int c(source_top_left.column()); c <= source_bottom_right.column(); ++c) {
-      QModelIndex proxyIndex = mapFromSource(sourceModel()->index(r, c));
-      // qDebug() << "   maps to" << proxyIndex;
-      if (!proxyIndex.isValid()) return;     // incomplete record with missing id value; safely ignore as not used in QXTreeModel
-      else emit dataChanged(proxyIndex, proxyIndex);}}
+   if ((source_top_left.column() <= boost::numeric_cast<int>(idCol()) && source_bottom_right.column() >= boost::numeric_cast<int>(idCol())) ||
+       (source_top_left.column() <= boost::numeric_cast<int>(parentCol()) && source_bottom_right.column() >= boost::numeric_cast<int>(parentCol()))){
+      for (int r(source_top_left.row()); r <= source_bottom_right.row(); ++r) reindexRow(r);}
+   forwardDataChanged(source_top_left.row(), source_bottom_right.row(), source_top_left.column(), source_bottom_right.column());
+   updateDeletedRows(source_top_left.row(), source_bottom_right.row());
+   emitRoleChanges();}
+
+/* Emits dataChanged() for a range of source rows: rows are grouped by their parent and each run of adjacent siblings
+   is reported by a single signal. */
+void QXTreeProxyModel::forwardDataChanged(int firstSourceRow, int lastSourceRow, int firstColumn, int lastColumn){
+   QList<qint32> parentIds;
+   QHash<qint32, QList<int> > positionsFromParentId;
+   for (int r(firstSourceRow); r <= lastSourceRow && r < d_index.idFromRow.count(); ++r){
+      qint32 id = d_index.idFromRow.at(r);
+      // incomplete record with missing id value or record not part of the tree; safely ignore as not used in QXTreeModel
+      if (id == 0 || !d_index.positionFromId.contains(id)) continue;
+      qint32 parentId = d_index.parentFromId.value(id);
+      if (!positionsFromParentId.contains(parentId)) parentIds << parentId;
+      positionsFromParentId[parentId] << d_index.positionFromId.value(id);}
+   foreach (qint32 parentId, parentIds){
+      if (!isAttached(parentId)) continue;
+      QList<int>& positions = positionsFromParentId[parentId];
+      qSort(positions);
+      const QVector<qint32>& siblings = childIds(parentId);
+      int first(0);
+      while (first < positions.count()){
+         int last(first);
+         while (last + 1 < positions.count() && positions.at(last + 1) <= positions.at(last) + 1) ++last;
+         emit dataChanged(createIndex(positions.at(first), firstColumn, siblings.at(positions.at(first))),
+                          createIndex(positions.at(last), lastColumn, siblings.at(positions.at(last))));
+         first = last + 1;}}}
 
 
 void QXTreeProxyModel::sourceHeaderDataChanged(Qt::Orientation orientation, int start, int end){
-   emit headerDataChanged(orientation, start, end);}
+   emit headerDataChanged(orientation, start, end);
+   if (orientation == Qt::Horizontal) d_columnFlags.clear();
+   if (orientation != Qt::Vertical) return;
+   if (d_builder){      // deletion marks are part of the snapshot being built, see asyncBuild
+      d_buildRestart = true;
+      return;}
+   updateDeletedRows(start, end);}
+
+/* Re-reads the deletion mark of the source rows first to last: a row deleted or a deletion reverted updates the cache
+   and redraws the entire row (font is struck out). Deletions are announced by the vertical header, reverted deletions
+   in Qt 4 only by dataChanged() (QSqlTableModel::revertRow()). */
+void QXTreeProxyModel::updateDeletedRows(int firstSourceRow, int lastSourceRow){
+   int first(-1);
+   for (int r(firstSourceRow); r <= lastSourceRow + 1; ++r){
+      bool changed = r <= lastSourceRow && r < d_index.deletedRows.size() && sourceRowDeleted(r) != d_index.deletedRows.testBit(r);
+      if (changed){
+         d_index.deletedCount += d_index.deletedRows.toggleBit(r) ? -1 : 1;     // toggleBit returns the previous value
+         if (first < 0) first = r;}
+      else if (first >= 0){
+         forwardDataChanged(first, r - 1, 0, columnCount() - 1);
+         first = -1;}}}
+
+void QXTreeProxyModel::relationModelChanged(){
+   d_relationKeys.clear();}
+
+// the worker thread finished: swap in its result by a single reset, or start again if the source changed meanwhile
+void QXTreeProxyModel::indexBuilt(){
+   if (!d_builder) return;     // cancelBuild() disconnects, thus a signal from a cancelled build does not arrive here
+   IndexBuilder* builder = d_builder;
+   d_builder = 0;
+   builder->deleteLater();
+   if (d_buildRestart){
+      startBuild();
+      return;}
+   beginResetModel();
+   d_index = builder->index;
+   d_integrityReport = builder->report;
+   endResetModel();
+   emit buildFinished();}
 
 void QXTreeProxyModel::sourceReset(){
-   reset();}
+   beginResetModel();
+   d_columnFlags.clear();
+   resetIndex();
+   endResetModel();}
 
 void QXTreeProxyModel::sourceLayoutAboutToBeChanged(){
    // qDebug() << "sourceLayoutAboutToBeChanged";
@@ -756,38 +1738,134 @@ void QXTreeProxyModel::sourceLayoutAboutToBeChanged(){
 
 void QXTreeProxyModel::sourceLayoutChanged(){
    // qDebug() << "sourceLayoutChanged";
+   if (d_builder){      // nothing shown yet, see asyncBuild
+      d_buildRestart = true;
+      emit layoutChanged();
+      return;}
+   QModelIndexList oldIndexes = persistentIndexList();
+   if (d_asyncBuild){      // no synchronous build: end the layout change with all items gone, then reset
+      QModelIndexList newIndexes;
+      for (int i(0); i < oldIndexes.count(); ++i) newIndexes << QModelIndex();
+      changePersistentIndexList(oldIndexes, newIndexes);
+      emit layoutChanged();
+      beginResetModel();
+      startBuild();
+      endResetModel();
+      return;}
+   buildIndex();     // rows might have been sorted, thus sibling order might have changed
+   QModelIndexList newIndexes;
+   foreach (QModelIndex idx, oldIndexes){
+      qint32 id = getId(idx);
+      if (d_index.positionFromId.contains(id)) newIndexes << createIndex(d_index.positionFromId.value(id), idx.column(), id);
+      else newIndexes << QModelIndex();}
+   changePersistentIndexList(oldIndexes, newIndexes);
    emit layoutChanged();}
 
 void QXTreeProxyModel::sourceRowsAboutToBeInserted(const QModelIndex &source_parent, int start, int end){
    // qDebug() << "sourceRowsAboutToBeInserted:" << source_parent << "from start" << start << "to end" << end;
    Q_UNUSED(source_parent);
-   Q_UNUSED(start);
-   Q_UNUSED(end);
-   emit beginResetModel();}
+   if (d_builder){      // index is being built from the previous content, see asyncBuild
+      d_buildRestart = true;
+      return;}
+   // the new rows have no content yet, thus their position in the tree is only known in sourceRowsInserted;
+   // a (re-)population of the source model, e.g. by QSqlTableModel::select() after removing all rows, is cheaper
+   // forwarded as reset; an empty model has no expansion state to lose
+   d_rowsResetPending = d_index.idFromRow.isEmpty();
+   if (d_rowsResetPending) emit beginResetModel();}
 
 void QXTreeProxyModel::sourceRowsInserted(const QModelIndex &source_parent, int start, int end){
    // qDebug() << "sourceRowsInserted:" << source_parent << "from start" << start << "to end" << end;
    Q_UNUSED(source_parent);
+   if (d_builder){      // index is being built from the previous content, see asyncBuild
+      d_buildRestart = true;
+      return;}
    Q_ASSERT(source_parent == QModelIndex());
-   Q_UNUSED(start);
-   Q_UNUSED(end);
-   emit endResetModel();
-   // qDebug() << "emit endResetModel completed; now all rows will be removed and re-added";
+   int count = end - start + 1;
+   d_insertedFirstRow = start;
+   d_insertedLastRow = end;
+   d_index.idFromRow.insert(start, count, 0);
+   shiftDeletedRows(start, count);
+   renumberRows(start + count);
+   if (d_rowsResetPending){
+      resetIndex();     // all rows are new: a full build, not one insertion per row
+      d_rowsResetPending = false;
+      emit endResetModel();
+      return;}
+   // group new records by parent; the new children of each parent are appended as adjacent siblings
+   QList<qint32> parentIds;
+   QHash<qint32, QList<int> > rowsFromParentId;
+   QSet<qint32> newIds;
+   QList<int> otherRows;      // not (yet) part of the tree or duplicate id
+   for (int r(start); r <= end; ++r){
+      qint32 id = sourceId(r);
+      bool ok(parentCol() >= 0);
+      qint32 parentId = ok ? sourceParentId(r, &ok) : 0;
+      if (id == 0 || !ok || d_index.rowFromId.contains(id) || newIds.contains(id)) otherRows << r;
+      else {
+         newIds << id;
+         if (!rowsFromParentId.contains(parentId)) parentIds << parentId;
+         rowsFromParentId[parentId] << r;}}
+   foreach (qint32 parentId, parentIds){
+      const QList<int>& rows = rowsFromParentId[parentId];
+      bool visible = isAttached(parentId);     // also true for a parent inserted by a previous group
+      if (visible) {
+         int position = childIds(parentId).count();
+         emit beginInsertRows(proxyIndexFromId(parentId), position, position + rows.count() - 1);}
+      foreach (int r, rows) indexRow(r);
+      if (visible) emit endInsertRows();}
+   foreach (int r, otherRows) indexRow(r);
+   emitRoleChanges();
    Q_ASSERT(sourceModel()->hasIndex(start, idCol(), source_parent));}
 
 void QXTreeProxyModel::sourceRowsAboutToBeRemoved(const QModelIndex &source_parent, int start, int end){
    // qDebug() << "sourceRowsAboutToBeRemoved: " << source_parent << "from start" << start << "to end" << end;
    Q_UNUSED(source_parent);
-   Q_UNUSED(start);
-   Q_UNUSED(end);
-   emit beginResetModel();}
+   if (d_builder){      // index is being built from the previous content, see asyncBuild
+      d_buildRestart = true;
+      return;}
+   d_rowsResetPending = (start == 0 && end >= d_index.idFromRow.count() - 1);      // e.g. QSqlTableModel::select()
+   if (d_rowsResetPending){
+      emit beginResetModel();
+      return;}
+   // group removed records by parent; remove each contiguous run of siblings at once, starting with the last one
+   QList<qint32> parentIds;
+   QHash<qint32, QList<int> > positionsFromParentId;
+   for (int r(start); r <= end; ++r){
+      qint32 id = d_index.idFromRow.at(r);
+      if (id == 0 || d_index.rowFromId.value(id) != r || !d_index.parentFromId.contains(id)) continue;
+      qint32 parentId = d_index.parentFromId.value(id);
+      if (!positionsFromParentId.contains(parentId)) parentIds << parentId;
+      positionsFromParentId[parentId] << d_index.positionFromId.value(id);}
+   foreach (qint32 parentId, parentIds){
+      QList<int> positions = positionsFromParentId.value(parentId);
+      qSort(positions);
+      bool visible = isAttached(parentId);
+      int last(positions.count() - 1);
+      while (last >= 0){
+         int first(last);
+         while (first > 0 && positions.at(first - 1) == positions.at(first) - 1) --first;
+         if (visible) emit beginRemoveRows(proxyIndexFromId(parentId), positions.at(first), positions.at(last));
+         const QVector<qint32> siblings = childIds(parentId);
+         for (int pos(positions.at(last)); pos >= positions.at(first); --pos) unindexRow(d_index.rowFromId.value(siblings.at(pos)));
+         if (visible) emit endRemoveRows();
+         last = first - 1;}}
+   for (int r(start); r <= end; ++r) unindexRow(r);}     // remaining rows, e.g. without id
 
 void QXTreeProxyModel::sourceRowsRemoved(const QModelIndex &source_parent, int start, int end){
    // qDebug() << "sourceRowsRemoved: " << source_parent << "from start" << start << "to end" << end;
    Q_UNUSED(source_parent);
-   Q_UNUSED(start);
-   Q_UNUSED(end);
-   emit endResetModel();}
+   if (d_builder){      // index is being built from the previous content, see asyncBuild
+      d_buildRestart = true;
+      return;}
+   d_index.idFromRow.remove(start, end - start + 1);
+   shiftDeletedRows(start, -(end - start + 1));
+   if (d_rowsResetPending){
+      resetIndex();
+      d_rowsResetPending = false;
+      emit endResetModel();}
+   else {
+      renumberRows(start);
+      emitRoleChanges();}}
 
 void QXTreeProxyModel::sourceColumnsAboutToBeInserted(const QModelIndex &source_parent, int start, int end){
    // qDebug() << "sourceColumnsAboutToBeInserted" << source_parent << start << end;
@@ -805,20 +1883,10 @@ void QXTreeProxyModel::sourceColumnsInserted(const QModelIndex &source_parent, i
    Q_UNUSED(end);
    int columnsAdded = end - start + 1;
    Q_ASSERT(columnsAdded > 0);
-   if (parentCol() < idCol()){   // order matters: to ensure that never idCol == parentCol (assert violation in setter)
-      if (idCol() >= start) {
-         bool ok = setIdCol(idCol() + columnsAdded);
-         Q_ASSERT(ok);}
-      if (parentCol() >= start) {
-         bool ok = setParentCol(parentCol() + columnsAdded);
-         Q_ASSERT(ok);}}
-   else {
-      if (parentCol() >= start){
-         bool ok = setParentCol(parentCol() + columnsAdded);
-         Q_ASSERT(ok);}
-      if (idCol() >= start) {
-         bool ok = setIdCol(idCol() + columnsAdded);
-         Q_ASSERT(ok);}}
+   // shift column numbers directly: the setters would rebuild the index, which is not affected by column positions
+   if (idCol() >= start) idColumn += columnsAdded;
+   if (parentCol() >= start) parentColumn += columnsAdded;
+   d_columnFlags.clear();
    emit endInsertColumns();} // now associated treeViews will update
 
 void QXTreeProxyModel::sourceColumnsAboutToBeRemoved(const QModelIndex &source_parent, int start, int end){
@@ -833,4 +1901,5 @@ void QXTreeProxyModel::sourceColumnsRemoved(const QModelIndex &source_parent, in
    Q_UNUSED(source_parent);
    Q_UNUSED(start);
    Q_UNUSED(end);
+   d_columnFlags.clear();
    emit endRemoveColumns();} //endResetModel();}
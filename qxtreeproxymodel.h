@@ -2,24 +2,53 @@
 #define QXTREEPROXYMODEL_H
 
 class QSortFilterProxyModel;
+class QSqlTableModel;
+class QSqlRelationalTableModel;
+class QAtomicInt;
 #include <QAbstractProxyModel>
 #include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QBitArray>
 
 class QXTreeProxyModel : public QAbstractProxyModel{
    Q_OBJECT
    Q_PROPERTY(int idCol READ idCol WRITE setIdCol)
    Q_PROPERTY(int parentCol READ parentCol WRITE setParentCol)
+   Q_PROPERTY(bool cacheColumnFlags READ cacheColumnFlags WRITE setCacheColumnFlags)
+   Q_PROPERTY(bool lazyFetching READ lazyFetching WRITE setLazyFetching)
+   Q_PROPERTY(bool asyncBuild READ asyncBuild WRITE setAsyncBuild)
    struct EXDatabase{
       EXDatabase(QLatin1String _msg = QLatin1String(""), qint32 _id = 0): msg(_msg), id(_id){};
       QString msg;
       qint32 id;};
 public:
+   enum ItemDataRole {SubtreeSizeRole = Qt::UserRole + 1000, DepthRole};
+   // violations of the requirements on the source model, found while building the tree
+   struct IntegrityReport{
+      QList<int> invalidRows;          // source rows without valid id or with a parent field that is no integer
+      QList<qint32> duplicateIds;      // ids that occur in more than one record; only the first record is in the tree
+      QList<qint32> orphanIds;         // records whose parent does not exist
+      QList<qint32> cycleIds;          // records that are their own ancestor
+      int unreachableRecords;          // records not in the tree due to the above, including their descendants
+      IntegrityReport(): unreachableRecords(0) {}
+      bool isValid() const {return invalidRows.isEmpty() && duplicateIds.isEmpty() && orphanIds.isEmpty() && cycleIds.isEmpty();}};
    QXTreeProxyModel(QObject* parent = 0);
    ~QXTreeProxyModel();
    int idCol() const;
    bool setIdCol(unsigned int col);
    int parentCol() const;
    bool setParentCol(unsigned int col);
+   bool cacheColumnFlags() const;
+   void setCacheColumnFlags(bool enable);
+   bool lazyFetching() const;
+   void setLazyFetching(bool enable);
+   bool asyncBuild() const;
+   void setAsyncBuild(bool enable);
+   bool isBuilding() const;
+   IntegrityReport integrityReport() const;
+   int subtreeSize(qint32 id) const;
+   int depth(qint32 id) const;
    /*!
      \brief defines default values for newly added records (i.e., rows)
 
@@ -42,9 +71,8 @@ public:
      will most often conatin QVarient().
    */
    void setDefaultValues(QList<QVariant> newDefaultValues) {d_defaultValues = newDefaultValues;}
-   /* lazy model not needed, as lazyness is inherited from underlying source model
    void fetchMore(const QModelIndex &parent);
-   bool canFetchMore(const QModelIndex &parent) const; */
+   bool canFetchMore(const QModelIndex &parent) const;
    QModelIndex mapToSource(const QModelIndex& proxyIndex) const;
    QModelIndex mapFromSource(const QModelIndex& sourceIndex) const;
    QModelIndex index(int row, int column, const QModelIndex& parent /*= QModelIndex()*/) const;
@@ -72,21 +100,137 @@ public:
    QSize span(const QModelIndex &index) const;
    public slots: bool submit();
    public slots: void revert(); */
+signals:
+   void buildProgress(int rows, int totalRows);
+   void buildFinished();
 private:
    Q_DISABLE_COPY(QXTreeProxyModel)
+   enum {IdHashShards = 64};
+   static int idShard(qint32 id) {return int(quint32(id) % IdHashShards);}
+   // hash keyed by record id, split into shards by the id, thus a full build can fill each shard on a thread of its own
+   template <typename T> class IdHash{
+   public:
+      IdHash(): d_shards(IdHashShards) {}
+      QHash<qint32, T>* shards() {return d_shards.data();}      // detaches once, before the shards are filled concurrently
+      const QHash<qint32, T>& shard(int s) const {return d_shards.at(s);}
+      QHash<qint32, T>& shardFor(qint32 id) {return d_shards[idShard(id)];}
+      const QHash<qint32, T>& shardFor(qint32 id) const {return d_shards.at(idShard(id));}
+      bool contains(qint32 id) const {return shardFor(id).contains(id);}
+      const T value(qint32 id) const {return shardFor(id).value(id);}
+      const T value(qint32 id, const T& defaultValue) const {return shardFor(id).value(id, defaultValue);}
+      void insert(qint32 id, const T& value) {shardFor(id).insert(id, value);}
+      int remove(qint32 id) {return shardFor(id).remove(id);}
+      T take(qint32 id) {return shardFor(id).take(id);}
+      T& operator[](qint32 id) {return shardFor(id)[id];}
+      int count() const {
+         int result(0);
+         for (int s(0); s < IdHashShards; ++s) result += d_shards.at(s).count();
+         return result;}
+      void reserve(int size) {
+         for (int s(0); s < IdHashShards; ++s) d_shards[s].reserve(size / IdHashShards + 1);}
+   private:
+      QVector<QHash<qint32, T> > d_shards;};
+   // lookup structures mirroring the id column of the source model, see buildIndex()
+   struct TreeIndex{
+      QVector<qint32> idFromRow;       // id of each source row, 0 if the row has no valid id (yet)
+      IdHash<int> rowFromId;           // source row of each id (first occurrence for duplicate ids)
+      QSet<qint32> duplicateIds;
+      IdHash<qint32> parentFromId;                       // parent id of each id with a valid parent field
+      IdHash<QVector<qint32> > childrenFromId;           // child ids of each parent id, in order of appearance
+      IdHash<int> positionFromId;                        // row of each id among its siblings, i.e., the proxy row
+      qint32 maxId;
+      QBitArray deletedRows;                             // source rows with a pending (not yet submitted) deletion
+      int deletedCount;                                  // number of bits set in deletedRows
+      IdHash<int> sizeFromId;                            // records in the branch of each attached id, for 0 all attached records
+      IdHash<int> depthFromId;                           // number of ancestors of each id attached to the root
+      TreeIndex(): maxId(0), deletedCount(0) {}};
+   // copies of the id and parent columns of the source model, the input of a full build of the index
+   struct SourceColumns{
+      QVector<qint32> ids;             // 0 for rows without valid id
+      QVector<qint32> parentIds;
+      QBitArray parentValid;           // parent field is empty or an integer
+      QBitArray deletedRows;};
    qint32 lastInsertedId;
    int idColumn;
    int parentColumn;
+   TreeIndex d_index;
+   IntegrityReport d_integrityReport;
+   static void checkIntegrity(const TreeIndex& index, bool hasParents, IntegrityReport& report);
+   int d_buildCount;             // incremented by each full build of the index, i.e., by each source reset
+   bool d_rowsResetPending;      // source row insertion/removal is forwarded as model reset
+   int d_insertedFirstRow;       // range of the most recent source row insertion
+   int d_insertedLastRow;
+   void buildIndex();
+   void readColumns(SourceColumns& columns) const;
+   static void buildTree(TreeIndex& index, const SourceColumns& columns, const QAtomicInt* cancelled, QXTreeProxyModel* progressReceiver);
+   enum {ParallelBuildRows = 1 << 18};                // smallest table built on several cores
+   struct ParallelBuild;
+   enum BuildPhase {BucketIds, IndexIds, BucketChildren, LinkChildren, MeasureBranches, IndexRecords};
+   static void buildTreeParallel(TreeIndex& index, const SourceColumns& columns, int threads, const QAtomicInt* cancelled, QXTreeProxyModel* progressReceiver);
+   static void runBuildPhase(ParallelBuild& build, BuildPhase phase, int parts);
+   static void buildPart(ParallelBuild* build, int phase, int part);
+   static void measureRows(const TreeIndex& index, qint32 branchId, int* depths, int* sizes);
+   class IndexBuilder;
+   IndexBuilder* d_builder;      // worker thread building the index, 0 if none, see asyncBuild
+   bool d_asyncBuild;
+   bool d_buildRestart;          // source model changed while building
+   void resetIndex();
+   void startBuild();
+   void cancelBuild();
+   qint32 sourceId(int sourceRow) const;
+   qint32 sourceParentId(int sourceRow, bool* ok) const;
+   void indexRow(int sourceRow);
+   void unindexRow(int sourceRow);
+   void reindexRow(int sourceRow);
+   void renumberRows(int firstSourceRow);
+   void linkNode(qint32 id, int sourceRow);
+   void unlinkNode(qint32 id, bool keepBranch = false);
+   bool isAttached(qint32 id) const;
+   bool isInBranch(qint32 id, qint32 branchId) const;
+   static int measureBranch(TreeIndex& index, qint32 branchId, int branchDepth, QList<qint32>* measuredIds);
+   void forgetBranch(qint32 branchId);
+   void shiftBranchDepth(qint32 branchId, int delta);
+   QList<qint32> d_roleChangedIds;      // records with changed SubtreeSizeRole or DepthRole, see emitRoleChanges()
+   QHash<qint32, int> d_unlinkedDepth;  // depth of branches unlinked by unlinkNode(id, true), until linkNode() relinks them
+   void emitRoleChanges();
+   QSet<qint32> ancestorIds(qint32 id) const;
+   void forwardDataChanged(int firstSourceRow, int lastSourceRow, int firstColumn, int lastColumn);
+   const QVector<qint32>& childIds(qint32 parentId) const;
    QModelIndex sourceindexFromId(qint32 id) const;
-   QModelIndexList sourcechildrenFromId(qint32 id) const;
    qint32 getId(const QModelIndex& idx) const;
-   void removeChildRows(qint32 parentId);
-   int rowFromId(qint32 recordId, qint32 parentId) const;
+   QList<qint32> branchIds(const QList<qint32>& ids) const;
+   QModelIndex proxyIndexFromId(qint32 id, int column = 0) const;
    bool moveBranch(qint32 id, qint32 newParent);
+   bool copyBranches(const QList<qint32>& ids, qint32 newParent);
    bool copyBranch(qint32 id, qint32 newParent);
+   QSqlTableModel* sqlBranchSource() const;
+   bool sqlCopyBranches(QSqlTableModel* tableModel, const QList<qint32>& ids, qint32 newParent);
+   bool sqlRemoveBranches(QSqlTableModel* tableModel, const QList<qint32>& ids);
+   struct RelationKeys{
+      QSqlTableModel* relationModel;                 // model the map was built from
+      QHash<QString, QVariant> keyFromDisplay;       // key of the first row for duplicate display values
+      RelationKeys(): relationModel(0) {}};
+   mutable QHash<int, RelationKeys> d_relationKeys;  // per relation column of the source model, see relationKey()
+   QVariant relationKey(QSqlRelationalTableModel* relationalModel, int column, const QVariant& displayValue) const;
+   bool initInsertedRows(int firstSourceRow, int lastSourceRow, qint32 parentId);
    QList<QVariant> d_defaultValues;
    bool isSourceDeleted(QModelIndex sourceIndex) const;
-   qint32 nextFreeId() const;
+   Qt::ItemFlags sourceFlags(const QModelIndex& index) const;
+   mutable QVariant d_strikeOutFont;   // default font struck out, built on first use
+   bool d_cacheColumnFlags;
+   mutable QVector<int> d_columnFlags; // source flags of each column, -1 if not yet known
+   bool d_lazyFetching;
+   mutable QHash<qint32, int> d_expectedChildCount;   // number of children in the database of each parent id, see lazyFetching
+   mutable bool d_childCountsRead;                    // d_expectedChildCount is read (or reading failed)
+   mutable bool d_childCountsValid;
+   void readChildCounts() const;
+   int expectedChildCount(qint32 parentId) const;
+   void clearExpectedChildCounts();
+   bool sourceRowDeleted(int sourceRow) const;
+   void shiftDeletedRows(int sourceRow, int count);
+   void updateDeletedRows(int firstSourceRow, int lastSourceRow);
+   qint32 d_nextFreeId;
+   qint32 reserveIds(int count, qint32 minId = 1);
 private slots:
    void sourceDataChanged(const QModelIndex &source_top_left, const QModelIndex &source_bottom_right);
    void sourceHeaderDataChanged(Qt::Orientation orientation, int start, int end);
@@ -101,6 +245,8 @@ private slots:
    void sourceColumnsInserted(const QModelIndex &source_parent, int start, int end);
    void sourceColumnsAboutToBeRemoved(const QModelIndex &source_parent, int start, int end);
    void sourceColumnsRemoved(const QModelIndex &source_parent, int start, int end);
+   void relationModelChanged();
+   void indexBuilt();
 };
 
 